@@ -0,0 +1,62 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace NESemu
+{
+    const int CaptureWidth = 256;
+    const int CaptureHeight = 240;
+    const int CaptureFrameSize = CaptureWidth * CaptureHeight;
+
+    // Records finished frames without stalling the window loop.
+    // push() copies the palette indices into a preallocated ring, a worker thread
+    // converts and writes them.
+    struct Capture
+    {
+        enum Format
+        {
+            Raw,    // RGBA8888, frames appended to one file
+            Y4M,    // YUV4MPEG2 4:4:4, 60fps
+            PNG,    // <path>_000000.png, <path>_000001.png, ...
+        };
+
+        Capture();
+        ~Capture();
+
+        // dropFrames: when the ring is full, drop the new frame (true) or wait for the writer (false)
+        bool open(std::string path, Format format, bool dropFrames = true, std::size_t slots = 16);
+        void close();
+        bool isOpen() const { return m_running; }
+        void push(const uint8_t* frame);
+
+        void worker();
+        void writeFrame(const uint8_t* frame);
+
+        std::string m_path;
+        Format m_format;
+        bool m_dropFrames;
+        std::ofstream m_file;
+
+        std::vector<uint8_t> m_ring; // slots * CaptureFrameSize
+        std::size_t m_slots;
+        std::size_t m_head; // next slot to fill (emulation thread)
+        std::size_t m_tail; // next slot to write (worker thread)
+        std::vector<uint8_t> m_convert; // per-frame RGBA / YUV scratch, worker only
+
+        std::mutex m_mutex;
+        std::condition_variable m_notEmpty;
+        std::condition_variable m_notFull;
+        std::thread m_thread;
+        bool m_running;
+
+        std::atomic<uint64_t> m_pushed;
+        std::atomic<uint64_t> m_written;
+        std::atomic<uint64_t> m_dropped;
+    };
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+namespace NESemu
+{
+    /*
+    Packed pixels
+    0    : n - 1, n is the number of distinct palette indices in the pixels
+    1-n  : the palette indices, in order of their code
+    n+1- : LZ stream of the pixel codes, bit-packed LSB first with ceil(log2(n)) bits each
+
+    The NES shows at most 25 colors at once and most frames use far fewer,
+    so a frame usually packs to 2-4 bits per pixel before the LZ pass.
+
+    LZ stream tokens
+    0x00-0x7f : literal, (c + 1) bytes follow
+    0x80-0xbf : run, length (c & 0x3f) + 3, one byte to repeat follows
+    0xc0-0xff : match, length (c & 0x3f) + 4, uint16 little-endian distance follows
+    A length field of 0x3f continues in the following bytes, each adding up to 255.
+    */
+    struct FrameCodec
+    {
+        FrameCodec();
+
+        // appends to out, returns the number of bytes appended (none for count == 0)
+        std::size_t encode(const uint8_t* pixels, std::size_t count, std::vector<uint8_t>& out);
+        bool decode(const uint8_t* data, std::size_t size, uint8_t* pixels, std::size_t count);
+
+        void compress(const uint8_t* src, std::size_t size, std::vector<uint8_t>& out);
+        bool decompress(const uint8_t* src, std::size_t size, uint8_t* dst, std::size_t dst_size);
+
+        std::vector<uint8_t> m_packed;
+        std::vector<uint32_t> m_hash;
+    };
+}
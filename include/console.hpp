@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include "cartridge.hpp"
+#include "controller.hpp"
+#include "cpu.hpp"
+#include "ppu.hpp"
+#include "state.hpp"
+
+namespace NESemu
+{
+    // the machine without a window or local controller, both ports fed from the network
+    struct Console
+    {
+        Console();
+        bool load(const std::string& rom);
+        void emulate_frame();
+        void saveState(Snapshot& s) const;
+        void loadState(const Snapshot& s);
+
+        Cartridge m_cartridge;
+        PPU m_ppu;
+        CPU m_cpu;
+        NetController m_ports[2];
+        Screen m_screen;
+    };
+}
@@ -2,9 +2,11 @@
 #include <SFML/Window.hpp>
 #include <cstdint>
 #include <vector>
+#include "state.hpp"
 
 namespace NESemu
 {
+    struct InputMailbox;
     using KeyBinding = std::vector<sf::Keyboard::Key>;
 
     struct Controller
@@ -24,6 +26,8 @@ namespace NESemu
 
         virtual void write(uint8_t b) = 0;
         virtual uint8_t read() = 0;
+        virtual void save(ControllerSnapshot& s) const = 0;
+        virtual void load(const ControllerSnapshot& s) = 0;
 
     };
 
@@ -32,9 +36,14 @@ namespace NESemu
         PhyController();
         void write(uint8_t b);
         uint8_t read();
+        void save(ControllerSnapshot& s) const;
+        void load(const ControllerSnapshot& s);
+        // current key states, bit n is Buttons n
+        unsigned int poll() const;
 
         bool m_flag;
         unsigned int m_keyStates;
+        unsigned int m_latched;     // key states at the last strobe, for replays
         KeyBinding m_keyBindings;
     };
 
@@ -43,8 +52,11 @@ namespace NESemu
         NetController();
         void write(uint8_t b);
         uint8_t read();
+        void save(ControllerSnapshot& s) const;
+        void load(const ControllerSnapshot& s);
         bool m_flag;
         unsigned int m_keyStates;
         unsigned int m_netKeyState;
+        InputMailbox* m_mailbox;    // when set, m_netKeyState is refreshed from it at each strobe
     };
 }
\ No newline at end of file
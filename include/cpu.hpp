@@ -2,6 +2,7 @@
 #include "cartridge.hpp"
 #include "ppu.hpp"
 #include "controller.hpp"
+#include "state.hpp"
 
 namespace NESemu
 {
@@ -22,6 +23,11 @@ namespace NESemu
         void reset();
         void reset(uint16_t start_addr);
         void log();
+        void save(CPUSnapshot& s) const;
+        void load(const CPUSnapshot& s);
+        // everything but m_RAM
+        void saveRegisters(CPUSnapshot& s) const;
+        void loadRegisters(const CPUSnapshot& s);
 
         uint16_t getPC() { return r_PC; }
         
@@ -67,8 +73,11 @@ namespace NESemu
 
         Cartridge& m_cartridge;
         PPU& m_ppu;
-        Controller &m_controller1;
-        Controller &m_controller2;
+        // pointers so that a netplay mode can plug its own controllers in
+        Controller* m_controller1;
+        Controller* m_controller2;
         std::vector<uint8_t> m_RAM;
+        uint8_t m_dirtyPages; // bit n: m_RAM page n written since StateHash last looked
+        uint8_t m_forkDirty;  // the same since Forker last looked
     };
 };
\ No newline at end of file
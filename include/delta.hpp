@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "screen.hpp"
+
+namespace NESemu
+{
+    const int BlockSize = 8;
+    const int BlocksX = ScreenWidth / BlockSize;    // 32
+    const int BlocksY = ScreenHeight / BlockSize;   // 30
+    const int BlockCount = BlocksX * BlocksY;       // 960
+    const int MaxScroll = 8;
+
+    enum BlockCode
+    {
+        BlockSame,      // unchanged from the base frame
+        BlockMoved,     // equal to the base frame shifted by the frame's (dx, dy)
+        BlockRaw,       // 64 new pixels follow
+    };
+
+    /*
+    Delta payload
+    0   : int8 dx
+    1   : int8 dy
+    2-  : BlockCount 2bit codes, 4 per byte, block order is row-major
+    ... : 64 bytes per BlockRaw block, in block order
+
+    Scrolling games move most of the screen by a few pixels each frame, so one
+    global motion vector is searched (horizontal or vertical only) and blocks that
+    match the shifted base frame cost 2 bits instead of 64 bytes.
+    */
+    const int DeltaHeaderSize = 2 + BlockCount / 4;
+
+    // returns the payload size
+    std::size_t encode_delta(const uint8_t* frame, const uint8_t* base, std::vector<uint8_t>& out);
+    int delta_raw_blocks(const uint8_t* payload);
+    bool decode_delta(const uint8_t* payload, std::size_t size, const uint8_t* base, uint8_t* frame);
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+namespace NESemu
+{
+    /*
+    Frame loop for the side that keeps time (p1, or both in rollback mode)
+
+    One wait covers the frame tick and the socket: on Linux an epoll set with a
+    periodic timerfd and the transport's socket, so datagrams are handled as
+    they arrive and the thread otherwise sleeps until the next frame, with no
+    empty reads. SFML has no descriptor for window events, those are polled
+    once per tick. Elsewhere, or without a native socket, it sleeps until the
+    next tick.
+    */
+    struct EventLoop
+    {
+        enum Events
+        {
+            Tick = 1,       // a frame is due
+            Readable = 2,   // the socket has datagrams
+        };
+
+        EventLoop();
+        ~EventLoop();
+        bool open(std::chrono::microseconds interval, int socket);
+        void close();
+        // blocks until at least one event, returns the Events that happened
+        int wait();
+
+        std::chrono::microseconds m_interval;
+        int m_epoll;
+        int m_timer;
+        int m_socket;
+        std::chrono::steady_clock::time_point m_next;   // fallback
+
+        uint64_t m_statSyscalls;
+        uint64_t m_statWakeups;
+        uint64_t m_statTicks;
+        uint64_t m_statMissed;  // ticks that expired while a frame was still running
+    };
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "console.hpp"
+#include "state.hpp"
+
+namespace NESemu
+{
+    const int ForkPageSize = 0x100;
+    // CPU RAM, PPU RAM, OAM
+    const int ForkPages = 8 + 8 + 1;
+
+    using ForkPage = std::shared_ptr<const std::array<uint8_t, ForkPageSize>>;
+
+    // the parts of a Snapshot that are not paged, copied as they are
+    static_assert(offsetof(CPUSnapshot, m_RAM) + sizeof(CPUSnapshot::m_RAM) == sizeof(CPUSnapshot), "CPU RAM comes last");
+    static_assert(offsetof(PPUSnapshot, m_spriteMemory) + sizeof(PPUSnapshot::m_spriteMemory) ==
+                  offsetof(PPUSnapshot, m_scanlineSprites), "PPU memory comes first");
+    const std::size_t CPURegistersSize = offsetof(CPUSnapshot, m_RAM);
+    const std::size_t PPURegistersOffset = offsetof(PPUSnapshot, m_scanlineSprites);
+    const std::size_t PPURegistersSize = sizeof(PPUSnapshot) - PPURegistersOffset;
+
+    // One branch of a machine: memory as shared, immutable pages, the rest by value. Copying a Fork
+    // copies pointers; the ROM is never in it, any Console with the same cartridge can run it.
+    struct Fork
+    {
+        uint32_t m_romHash;
+        std::array<ForkPage, ForkPages> m_pages;
+        uint8_t m_palette[0x20];
+        uint8_t m_cpu[CPURegistersSize];
+        uint8_t m_ppu[PPURegistersSize];
+        ControllerSnapshot m_controllers[2];
+    };
+
+    /*
+    Copy-on-write forking of a Console
+
+    fork() captures the machine, sharing every page that still holds what
+    the last fork or load left in it and copying only the ones written
+    since, so a branch costs its registers, a few pointers and the pages
+    it changed. CPU and PPU mark the pages they write in m_forkDirty, kept
+    apart from the marks StateHash clears. load() puts a fork back in the
+    machine, copying only the pages whose pointer differs from the last
+    fork or load, or that were written since. Exploring many futures from
+    one state is load, run, fork, for each of them.
+    */
+    struct Forker
+    {
+        Forker(Console& console);
+        Fork fork();
+        // false when the fork is from another ROM
+        bool load(const Fork& fork);
+
+        Console& m_console;
+        uint32_t m_romHash;
+        Fork m_base;            // what the machine's memory was forked from or loaded from
+        Snapshot m_scratch;
+
+        uint64_t m_statShared;
+        uint64_t m_statCopied;  // by fork()
+        uint64_t m_statLoaded;  // by load()
+    };
+
+    // branches a ROM's machine many times with forks and with save states and prints time and memory of both
+    void fork_benchmark(const std::string& rom, int forks = 2048);
+}
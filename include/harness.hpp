@@ -0,0 +1,29 @@
+#pragma once
+#include "transport.hpp"
+
+namespace NESemu
+{
+    struct HarnessOptions
+    {
+        Shaping m_shaping;  // applied to what each side receives
+        int m_frames;
+        bool m_delta;
+        bool m_pack;
+        int m_fecGroup;
+        bool m_adaptive;
+    };
+
+    /*
+    Loopback harness
+
+    Runs a p1 host and a p2 client in one process over 127.0.0.1, ports port
+    and port+1, without a window or a ROM: p1 sends a synthetic moving frame
+    at 60fps from this thread, p2 reassembles on its network thread and a
+    second thread plays its window, sending an input and picking up the screen
+    every frame. Both sides receive through the shaping, so screen datagrams
+    and inputs see the same simulated network. At the end it prints
+    throughput, how many frames were decoded and shown, and the latency
+    percentiles. Returns false when not a single frame made it.
+    */
+    bool loopback_harness(unsigned short port, const HarnessOptions& options);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include "metrics.hpp"
+
+namespace NESemu
+{
+    const int MailboxReadTries = 4;
+
+    /*
+    Newest controller state of p2, between the thread that receives it and the emulation
+
+    The network thread publishes every input that is newer than the last one,
+    tagged with p2's input number; the
+    emulation thread takes whatever is newest when the game strobes the
+    controller. It is a seqlock with one writer, so neither side ever waits:
+    a read that raced a publish sees the sequence change and is repeated,
+    and an input overwritten before a strobe is counted as skipped.
+
+    Staleness is measured on the reading side, from the publish to the
+    strobe that consumed it, and printed every MailboxStatInterval strobes
+    with the inputs skipped and the strobes that found nothing new.
+    */
+    struct InputMailbox
+    {
+        InputMailbox();
+
+        // network thread
+        void publish(uint32_t input, uint8_t state);
+        // emulation thread: the newest state, false when there is none yet or the writer kept overtaking us
+        bool consume(uint8_t& state);
+        void report();
+
+        std::atomic<uint32_t> m_seq;    // odd while the writer is in the fields below
+        uint32_t m_input;               // p2's input number, 0 before the first
+        uint8_t m_state;
+        uint32_t m_time;                // timestamp_us() when published
+
+        // reader only
+        uint32_t m_consumed;            // input of the last strobe
+        uint32_t m_statStrobes;
+        uint32_t m_statRepeated;        // strobes that found the input of the one before
+        uint32_t m_statSkipped;         // inputs overwritten before a strobe took them
+        uint32_t m_statRetries;
+        Histogram m_age;                // us from publish to strobe
+    };
+}
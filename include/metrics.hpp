@@ -0,0 +1,33 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace NESemu
+{
+    // microseconds on this machine's steady clock, wrapping every 71 minutes;
+    // only differences mean something, compare as int32_t(a - b)
+    inline uint32_t timestamp_us()
+    {
+        return uint32_t(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    // the most recent samples of one measurement, for percentiles
+    struct Histogram
+    {
+        Histogram(std::size_t window = 1024);
+        void add(double value);
+        void clear();
+        std::size_t count() const { return m_count < m_samples.size() ? m_count : m_samples.size(); }
+        double percentile(double p) const;
+        // "name p50/p95/p99 unit", samples divided by scale
+        std::string summary(const char* name, double scale = 1000, const char* unit = "ms") const;
+
+        std::vector<double> m_samples;
+        std::size_t m_next;
+        std::size_t m_count;
+        mutable std::vector<double> m_sorted;
+    };
+}
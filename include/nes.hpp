@@ -7,16 +7,53 @@
 #include "cpu.hpp"
 #include "ppu.hpp"
 #include "netplug.hpp"
+#include "capture.hpp"
+#include "rollback.hpp"
+#include "spectator.hpp"
+#include "state.hpp"
+#include "eventloop.hpp"
+#include "pipeline.hpp"
+#include "shm.hpp"
+#include "ppustream.hpp"
+#include "savestate.hpp"
+#include "rewind.hpp"
+#include "runahead.hpp"
 
 namespace NESemu
 {
+    const int LoopStatInterval = 300;
+
     struct NES
     {
         NES(std::string rom_path, bool server, std::string ipaddr, int port);
         void setKeys(KeyBinding& p1);
+        bool setCapture(std::string path, Capture::Format format, bool dropFrames);
+        void setDelta(bool delta);
+        void setPack(bool pack);
+        void setFec(int group);
+        void setRollback(int inputDelay);
+        void setSpectator();
+        bool setSpectators(unsigned short port);
+        void setShaping(const Shaping& shaping);
+        void setAdaptive(bool adaptive);
+        void setSession(uint32_t id, int player, int rom);
+        void setPipeline(bool pipeline);
+        void setShm(const std::string& name);
+        void setSemantic(bool semantic);
+        void setInputThread(bool threaded);
+        void setStatePath(const std::string& path);
+        void setRewind(double megabytes, int interval);
+        void setRunAhead(int frames);
         void run();
         void update_controller();
         void update_screen();
+        void wait_frame();
+        void emulate_frame();
+        void saveState(Snapshot& s) const;
+        void loadState(const Snapshot& s);
+        // F5 / F9 on p1: the whole machine to and from m_statePath
+        void saveStateFile();
+        void loadStateFile();
 
         sf::RenderWindow m_window;
         std::string m_romPath;
@@ -28,9 +65,31 @@ namespace NESemu
         NetController m_controller2;
         Screen m_screen;
         float m_screenScale;
+        bool m_inputThreaded;
+        InputMailbox m_mailbox;    // before m_netplug: its input thread publishes here until it is joined
         Netplug m_netplug;
+        Capture m_capture;
+        Rollback m_rollback;
+        Spectators m_spectators;
+        bool m_pipelined;
+        SendPipeline m_pipeline;   // after m_netplug and m_spectators, stops before them
+        std::string m_shmName;
+        SharedLink m_shm;
+        PPUTrace m_trace;
+        PPUSnapshot m_traceStart;  // the PPU when m_trace began
+
+        std::string m_statePath;
+        uint32_t m_romHash;
+        std::vector<uint8_t> m_stateBuffer;
+        StateWriter m_stateWriter;
+        Rewind m_rewind;
+        int m_runAheadFrames;
+        RunAhead m_runAhead;
 
-        std::chrono::high_resolution_clock::time_point m_cycleTimer;
-        std::chrono::high_resolution_clock::duration m_elapsedTime;
+        EventLoop m_loop;
+        uint32_t m_statLoopFrames;
+        uint64_t m_lastLoopSyscalls;
+        uint64_t m_lastSocketSyscalls;
+        uint64_t m_lastWakeups;
     };
 }
\ No newline at end of file
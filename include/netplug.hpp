@@ -1,23 +1,355 @@
-#include <SFML/Network.hpp>
+#pragma once
 #include <screen.hpp>
 #include <controller.hpp>
+#include <codec.hpp>
+#include <delta.hpp>
+#include <transport.hpp>
+#include <metrics.hpp>
+#include <ratecontrol.hpp>
+#include <mailbox.hpp>
+#include <state.hpp>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace NESemu{
+    enum PacketType : uint8_t
+    {
+        ScreenKey,          // whole frame
+        ScreenDelta,        // delta mode: changed blocks against an acknowledged frame
+        ScreenKeyPacked,    // ScreenKey through FrameCodec
+        ScreenDeltaPacked,  // ScreenDelta with the raw blocks through FrameCodec
+        ScreenAck,          // p2 -> p1: frame decoded
+        ControllerState,    // p2 -> p1: newest input number, frame on screen, count, the last count inputs
+        RollbackInput,      // rollback mode, both ways: confirmed frame, first frame, count, inputs, hashed frame, hash
+        SpectatorJoin,      // spectator -> p1 spectator port: join, repeated as keepalive
+        ScreenParity,       // FEC mode: XOR of a group of screen chunks
+        Ping,               // both ways: sender's timestamp
+        Pong,               // reply: the ping's timestamp, replier's timestamp
+        ScreenReport,       // p2 -> p1: datagrams lost per mille, queueing delay in us, frames completed
+        SessionData,        // client -> server: session id, player, then any of the above from that player
+        SessionJoin,        // inside SessionData: ROM index, creates the session if new, repeated as keepalive
+        ScreenState,        // semantic mode: PPU state at the start of the frame and its register accesses, packed
+        ScreenStateDelta,   // the same with the state as a delta against an acknowledged frame's
+    };
+
+    // frames kept on both sides to delta against
+    const int ScreenHistory = 8;
+    const int KeyframeInterval = 120;
+
+    // p2: frames being reassembled at once, and how long an incomplete one is kept
+    const int FramesInFlight = 4;
+    const int FrameTimeoutMs = 100;
+    const int MaxJitterDepth = 2;
+    const int SpectatorJoinMs = 1000;
+    const int PingIntervalMs = 500;
+    const int ReportSize = 1 + 2 + 4 + 2;
+    const int PongSize = 1 + 2 * sizeof(uint32_t);
+    const int SessionHeaderSize = 1 + 4 + 1;
+    // adaptive rate, paced: datagrams go out this many at a time, spread over half a frame
+    const int PaceBurst = 4;
+    const int PaceSpanUs = 1'000'000 / 60 / 2;
+    // p2 measures queueing against the lowest transit time of the last two windows of this length
+    const int TransitWindowMs = 10000;
+
+    // p2 repeats its last InputRedundancy inputs in every ControllerState packet
+    const int InputRedundancy = 8;
+    const int InputHeaderSize = 1 + 4 + 4 + 1;
+    // p1 lets at most this many inputs wait before it skips ahead
+    const int InputQueueDepth = 2;
+    const int InputBuffer = 64;
+
+    // semantic frames: raw size, then the FrameCodec-compressed
+    // [events size][PPU state or its delta][PPUTrace events]
+    const int StateHeaderSize = 4;
+
+    // screen frames travel as chunks of a frame's payload behind this header,
+    // sized so a raw frame splits into whole scanlines
+    struct ChunkHeader
+    {
+        uint8_t m_type;
+        uint32_t m_frame;
+        uint32_t m_base;    // frame a delta applies to
+        uint32_t m_total;   // payload bytes of the frame
+        uint16_t m_index;   // chunk, or group for parity
+        uint16_t m_chunks;
+        uint32_t m_time;    // p1 timestamp_us() when the frame was sent
+        uint32_t m_input;   // last p2 input applied before the frame was emulated
+    };
+    const int ChunkHeaderSize = 1 + 4 * 3 + 2 * 2 + 4 * 2;
+    const int ChunkSize = (MaxDatagram - ChunkHeaderSize) / ScreenWidth * ScreenWidth;
+    const int MaxChunks = (DeltaHeaderSize + ScreenSize + ChunkSize - 1) / ChunkSize;
+    // chunk header, then the frame's type and the group size
+    const int ParityHeaderSize = ChunkHeaderSize + 2;
+    const int MaxFecGroup = 16;
+
+    // the group size sent for a requested one: 0 or less is off, a group of one datagram has no parity to send
+    inline int fec_group(int requested)
+    {
+        return requested <= 0 ? 0 : requested < 2 ? 2 : requested > MaxFecGroup ? MaxFecGroup : requested;
+    }
+
+    inline uint8_t* put_chunk_header(uint8_t* p, const ChunkHeader& h)
+    {
+        *p++ = h.m_type;
+        p = put32(p, h.m_frame);
+        p = put32(p, h.m_base);
+        p = put32(p, h.m_total);
+        p = put16(p, h.m_index);
+        p = put16(p, h.m_chunks);
+        p = put32(p, h.m_time);
+        return put32(p, h.m_input);
+    }
+
+    inline ChunkHeader get_chunk_header(const uint8_t* p)
+    {
+        return {p[0], get32(p + 1), get32(p + 5), get32(p + 9), get16(p + 13), get16(p + 15), get32(p + 17), get32(p + 21)};
+    }
+
+    inline void xor_into(uint8_t* dst, const uint8_t* src, std::size_t size)
+    {
+        for (std::size_t i = 0; i < size; ++i)
+            dst[i] ^= src[i];
+    }
+
+    using Clock = std::chrono::high_resolution_clock;
+
+    // chunks of one screen frame, p2 side
+    struct FrameSlot
+    {
+        bool m_used;
+        uint32_t m_frame;
+        uint8_t m_type;
+        uint32_t m_base;
+        uint32_t m_total;
+        uint16_t m_chunks;
+        uint64_t m_received; // bit n: chunk n arrived
+        uint8_t m_group;     // FEC group size, 0 until a parity datagram arrived
+        uint64_t m_parity;   // bit n: parity of group n arrived
+        uint32_t m_time;     // from the chunk header
+        uint32_t m_input;
+        Clock::time_point m_start;
+        std::vector<uint8_t> m_data;
+        std::vector<uint8_t> m_parityData;
+    };
+
+    // Hands finished frames from the network thread to the window loop without locks.
+    // The writer fills back() and publishes it; the reader takes the newest published
+    // frame. A third buffer is swapped between them so neither ever waits.
+    struct FrameExchange
+    {
+        FrameExchange();
+        uint8_t* back() { return m_buffers[m_back].data(); }
+        void publish(uint32_t id, uint32_t input);
+        const uint8_t* acquire(); // nullptr when nothing new was published
+
+        static const int Fresh = 4;
+        std::vector<uint8_t> m_buffers[3];
+        uint32_t m_ids[3];          // frame in each buffer
+        uint32_t m_inputs[3];       // and the last p2 input it reflects
+        int m_back;                 // writer only
+        int m_front;                // reader only
+        std::atomic<int> m_spare;   // buffer index | Fresh
+    };
+
+    struct PPUTrace;
+    struct StateRenderer;
+
+    struct NetInput
+    {
+        uint32_t m_seq;         // 0: empty
+        uint8_t m_state;
+        uint32_t m_displayed;   // p2's screen frame when it was read
+    };
+
     struct Netplug
     {
         Netplug(bool server, std::string ipaddr, int port);
+        ~Netplug();
         void plug();
         size_t send(void* data, size_t size);
         size_t receive(void* buf, size_t size);
-        void send_screen(Screen& screen);
+        // false when the adaptive rate skipped this frame
+        bool send_screen(Screen& screen);
+        // input: the last p2 input applied before the frame was emulated
+        bool send_screen(const uint8_t* matrix, uint32_t input);
+        // semantic mode: start is the PPU when the frame began, trace its accesses until the picture was done
+        bool send_state(const PPUSnapshot& start, const PPUTrace& trace, const uint8_t* matrix, uint32_t input);
+        void send_encoded(PacketType type, uint32_t base, const uint8_t* payload, std::size_t size, uint32_t input,
+                          Clock::time_point start);
+        uint32_t applied_input() const
+        {
+            if (m_mailbox)
+                return m_mailbox->m_consumed;
+            return m_inputNext ? m_inputNext - 1 : 0;
+        }
         void receive_screen(Screen& screen);
         void send_controller_state(PhyController& controller);
         void receive_controller_state(NetController& controller);
+        // p1: acks, inputs, pings and reports, whenever the socket has some
+        void receive_from_p2();
+        void receive_inputs(uint32_t newest, uint32_t displayed, const uint8_t* inputs, int count);
+        void apply_input(NetController& controller);
+        // p1: receives on its own thread and publishes each newer input, the controller takes it at its strobe
+        void start_input_thread(InputMailbox& mailbox);
+        void stop_input_thread();
+        void input_loop();
+        void send_ping();
+        // true when datagram was a ping and pong holds the answer to send
+        bool receive_ping(const Datagram& datagram, uint8_t* pong);
+        void lose_chunks(const FrameSlot& slot);
+        void send_report(Clock::time_point now);
+        void receive_report(const uint8_t* data);
+        void print_rate(double loss, uint32_t queueDelay);
+
+        void send_frame(PacketType type, uint32_t base, const uint8_t* payload, std::size_t size);
+        void receive_chunk(const uint8_t* data, std::size_t size);
+        void receive_parity(const uint8_t* data, std::size_t size);
+        FrameSlot* find_slot(const ChunkHeader& header);
+        void recover(FrameSlot& slot, int group);
+        void complete(FrameSlot& slot);
+        bool decode_frame(FrameSlot& slot);
+        bool decode_state(FrameSlot& slot);
+        void expire_frames(Clock::time_point now);
+        bool present_frame(bool force);
+
+        // p2: socket I/O and reassembly on their own thread, receive_screen only picks up finished frames
+        void start_receiver();
+        void stop_receiver();
+        void receive_loop();
+        void receive_datagrams();
+        uint8_t* history(uint32_t frame) { return &m_history[(frame % ScreenHistory) * ScreenSize]; }
+        bool inHistory(uint32_t frame) { return m_historyIds[frame % ScreenHistory] == frame; }
+        uint8_t* stateHistory(uint32_t frame) { return &m_stateHistory[(frame % ScreenHistory) * m_stateSize]; }
+        bool inStateHistory(uint32_t frame) { return m_stateIds[frame % ScreenHistory] == frame; }
 
         bool m_server;
         std::string m_ipaddr;
         int m_port;
 
-        sf::UdpSocket m_socket;
+        Transport m_transport;
+
+        // delta mode
+        bool m_delta;
+        uint32_t m_frame;           // p1: last sent, p2: last decoded
+        uint32_t m_ackFrame;        // p1: newest frame p2 has decoded
+        uint32_t m_lastKeyframe;
+        // p1: the last frame as sent, for spectators
+        PacketType m_sentType;
+        uint32_t m_sentTime;
+        uint32_t m_sentInput;
+        uint32_t m_sentBase;
+        const uint8_t* m_sentPayload;
+        std::size_t m_sentSize;
+        bool m_pacing;              // this frame's datagrams are paced
+        // p1: what p2 reports back (acks, rate reports, pongs) and the sender reads,
+        // for when the sender runs on a pipeline worker
+        std::mutex m_feedbackLock;
+        std::vector<uint8_t> m_history;
+        std::vector<uint32_t> m_historyIds;
+        std::vector<uint32_t> m_historyInputs;  // p2: last input of ours each decoded frame reflects
+        std::vector<uint8_t> m_payload;
+
+        // p2: reassembly and jitter buffer
+        FrameSlot m_slots[FramesInFlight];
+        std::vector<uint32_t> m_ready;  // decoded, not yet shown, oldest first
+        uint32_t m_presented;           // last frame shown
+        int32_t m_lastTransit;          // p2 clock at completion - p1 clock at sending, of the last frame
+        bool m_haveTransit;
+        double m_jitter;                // RFC 3550 estimate of frame arrival jitter, in us
+        int m_depth;                    // frames held back to absorb jitter
+        FrameExchange m_exchange;
+        uint32_t m_decoded;             // since the start, for the loopback harness
+        std::thread m_receiver;
+        std::atomic<bool> m_receiving;
+        bool m_spectator;               // watching p1's spectator port, sends no inputs
+        Clock::time_point m_lastJoin;
+
+        // report
+        uint64_t m_statBytes;
+        uint32_t m_statFrames;
+        uint32_t m_statKeyframes;
+        Clock::duration m_statTime; // p1: encode, p2: decode
+        uint32_t m_statLate;        // p2: chunks or frames older than what is already decoded
+        uint32_t m_statDropped;     // p2: frames never shown
+        uint32_t m_statTorn;        // p2: frames given up with chunks missing
+        uint32_t m_statRecovered;   // p2: chunks rebuilt from parity
+
+        // FEC mode: one parity datagram per m_fecGroup screen datagrams, 0 = off
+        int m_fecGroup;
+
+        // adaptive rate: p1 follows p2's reports
+        RateControl m_rate;
+        Clock::time_point m_lastReport;
+        uint32_t m_reportChunks;        // p2, since the last report: arrived
+        uint32_t m_reportLost;          // never arrived
+        uint32_t m_reportFrames;
+        int64_t m_reportTransit;        // sum of transit above the minimum
+        int32_t m_minTransit[2];        // previous and current window
+        Clock::time_point m_transitWindow;
+
+        // inputs, p2 side
+        uint32_t m_displayed;       // frame on screen, window thread
+        uint32_t m_inputSeq;
+        uint8_t m_inputHistory[InputRedundancy];
+        // p1 side
+        NetInput m_inputs[InputBuffer];
+        uint32_t m_inputNext;       // next to apply, 0 before the first packet
+        uint32_t m_inputNewest;
+        uint32_t m_statInputFrames;
+        uint32_t m_statInputs;
+        uint32_t m_statInputsLate;  // arrived, but after we had to skip past them
+        uint32_t m_statInputsLost;  // never arrived
+        uint32_t m_statInputStalls; // frames emulated with no new input
+        uint64_t m_statInputAge;    // sum of p1 frame - p2 frame on screen, per applied input
+        InputMailbox* m_mailbox;    // set while the input thread runs
+        std::thread m_inputThread;
+        std::atomic<bool> m_inputRunning;
+
+        // latency, p50/p95/p99 with the screen stats
+        Clock::time_point m_lastPing;
+        int32_t m_clockOffset;      // p2: p1 clock - p2 clock, from the fastest ping
+        uint32_t m_bestRtt;         // UINT32_MAX until a pong arrived
+        Histogram m_rtt;
+        Histogram m_encodeTime;     // p1
+        Histogram m_sendTime;       // p1
+        Histogram m_delivery;       // p2: p1 sending a frame to p2 having all of it, one way
+        Histogram m_receiveTime;    // p2: first to last chunk of a frame
+        Histogram m_decodeTime;     // p2
+        uint32_t m_statLostChunks;  // p2: missing from torn frames or rebuilt from parity
+        uint32_t m_statReordered;   // p2: chunks arriving behind a later one
+        uint32_t m_lastFrameSeen;
+        uint16_t m_lastIndexSeen;
+        // p2 window thread: reading an input to showing the first frame that used it
+        uint32_t m_inputTimes[InputBuffer];
+        uint32_t m_shownInput;
+        uint32_t m_statShown;
+        Histogram m_inputLatency;
+
+        // packed mode
+        bool m_pack;
+        FrameCodec m_codec;
+        std::vector<uint8_t> m_packed;
+
+        // semantic mode: p1 sends PPU state and register accesses, p2 renders them with its own cartridge
+        bool m_semantic;
+        std::size_t m_stateSize;
+        std::vector<uint8_t> m_stateHistory;    // PPU state at the start of each frame
+        std::vector<uint32_t> m_stateIds;
+        std::vector<uint8_t> m_stateRaw;
+        std::string m_romPath;                  // p2: for the renderer
+        std::unique_ptr<StateRenderer> m_renderer;
+
+        bool m_verbose;             // periodic reports on stdout
+        // p2 of a server session, 0 = talking to a p1 directly
+        uint32_t m_session;
+        uint8_t m_player;
+        uint8_t m_rom;
     };
-}
\ No newline at end of file
+
+    // sends raw frames over loopback with simulated loss, with and without parity, and prints how many survive
+    void fec_benchmark(unsigned short port, int frames = 600);
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "metrics.hpp"
+#include "netplug.hpp"
+#include "spectator.hpp"
+
+namespace NESemu
+{
+    // frames that may wait for the encoder before new ones are dropped
+    const int PipelineDepth = 2;
+
+    /*
+    Send pipeline for p1
+
+    The emulation thread copies each finished framebuffer into a bounded
+    single-producer, single-consumer ring and goes on with the next frame;
+    a worker encodes and sends it to p2 (and the spectators), so frame N+1
+    is emulated while frame N is on its way. The ring indices are the only
+    thing the two threads share: the producer owns m_head, the worker
+    m_tail. The worker parks on a condition variable when the ring is empty
+    and the producer only takes the lock to wake it. A frame that finds the
+    ring full is dropped, p2 sees a skipped frame rather than a growing lag.
+    */
+    struct SendPipeline
+    {
+        SendPipeline();
+        ~SendPipeline();
+
+        void start(Netplug& netplug, Spectators& spectators);
+        void stop();
+        bool isRunning() const { return m_thread.joinable(); }
+        // emulation thread: false when the ring was full and the frame dropped
+        bool push(const uint8_t* matrix, uint32_t input, uint32_t emulateUs);
+
+        void worker();
+        void report();
+
+        struct Slot
+        {
+            std::vector<uint8_t> m_matrix;
+            uint32_t m_input;       // last p2 input applied before it was emulated
+            uint32_t m_emulateUs;
+            uint32_t m_depth;       // frames already queued when it was pushed
+            uint32_t m_queued;      // timestamp_us()
+        };
+        Slot m_slots[PipelineDepth + 1];    // +1 so that head == tail always means empty
+        std::atomic<uint32_t> m_head;       // next slot to fill
+        std::atomic<uint32_t> m_tail;       // next slot to send
+
+        std::mutex m_parkLock;
+        std::condition_variable m_wake;
+        std::atomic<bool> m_parked;
+        std::atomic<bool> m_running;
+        std::thread m_thread;
+        Netplug* m_netplug;
+        Spectators* m_spectators;
+
+        std::atomic<uint32_t> m_statDropped;
+        // worker
+        uint32_t m_statFrames;
+        uint32_t m_statDepthSum;
+        uint32_t m_statDepthMax;
+        Histogram m_emulateTime;
+        Histogram m_queueTime;      // pushed to picked up by the worker
+        Histogram m_stageTime;      // encode, send and spectators
+    };
+}
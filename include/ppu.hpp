@@ -5,6 +5,7 @@
 #include "screen.hpp"
 #include "cartridge.hpp"
 #include "cpu.hpp"
+#include "state.hpp"
 
 /*
 パレットの色が
@@ -28,11 +29,17 @@ namespace NESemu
     const int AttributeOffset = 0x3C0;
 
     struct CPU;
+    struct PPUTrace;
     struct PPU
     {    
         PPU(Cartridge& cartridge, CPU& cpu, Screen& screen);
         void step();
         void reset();
+        void save(PPUSnapshot& s) const;
+        void load(const PPUSnapshot& s);
+        // everything but m_RAM, m_palette and m_spriteMemory
+        void saveRegisters(PPUSnapshot& s) const;
+        void loadRegisters(const PPUSnapshot& s);
 
         void doDMA(const uint8_t* page_ptr);
 
@@ -109,6 +116,18 @@ namespace NESemu
 
         uint16_t m_dataAddrIncrement;
 
-        std::vector<std::vector<uint8_t>> m_pictureBuffer;
+        std::vector<uint8_t> m_pictureBuffer; // row-major: [y * ScanlineVisibleDots + x]
+
+        PPUTrace* m_trace; // semantic streaming: records register accesses while set
+
+        // written since StateHash last looked: bits 0-7 m_RAM pages, then OAM and the palette
+        enum Dirty : uint16_t
+        {
+            DirtyOAM = 1 << 8,
+            DirtyPalette = 1 << 9,
+            DirtyAll = 0x3ff,
+        };
+        uint16_t m_dirty;
+        uint16_t m_forkDirty;   // the same since Forker last looked
     };
 }
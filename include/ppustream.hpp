@@ -0,0 +1,78 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "console.hpp"
+#include "state.hpp"
+
+namespace NESemu
+{
+    // PPUSnapshot in a fixed, byte-order independent layout
+    const int PPUStateSize = 0x800 + 0x20 + 64 * 4 + 8 + 1 + 1 + 4 + 4 + 2 + 2 + 2 + 1 + 1 + 1 + 1 + 1 + 2;
+    void put_ppu_state(uint8_t* p, const PPUSnapshot& s);
+    void get_ppu_state(const uint8_t* p, PPUSnapshot& s);
+
+    // 7 bits a byte, low first, the high bit set on all but the last
+    void put_varint(std::vector<uint8_t>& out, uint32_t value);
+    bool get_varint(const uint8_t*& p, const uint8_t* end, uint32_t& value);
+
+    // run coders (the PPU state delta, the rewind buffer) merge changed runs this close: splitting them
+    // would cost a new run header, two varints, which is no cheaper than the unchanged bytes in between
+    const int RunMergeGap = 3;
+
+    // the bytes of state that differ from base, as (unchanged count, changed count, changed bytes) runs
+    void encode_state_delta(const uint8_t* base, const uint8_t* state, std::vector<uint8_t>& out);
+    bool decode_state_delta(const uint8_t* delta, std::size_t size, const uint8_t* base, uint8_t* state);
+
+    /*
+    PPU register accesses of one frame, for semantic streaming
+
+    Recorded from the snapshot at the start of a frame until the picture is
+    done, each with the number of PPU dots since the snapshot. Replaying them
+    at the same dots against the same snapshot and CHR data renders the same
+    picture: the PPU depends on nothing else. Accesses in the post-render and
+    vertical blank lines are not recorded, the next frame's snapshot has their
+    effect. Status reads are only recorded when they change something, so
+    polling for sprite 0 costs nothing.
+
+    Events: dot delta (varint), kind, then the value: 1 byte for writes, none for reads, the page for Dma
+    */
+    struct PPUTrace
+    {
+        enum Kind : uint8_t
+        {
+            Control,
+            Mask,
+            OAMAddress,
+            OAMData,
+            DataAddress,
+            Scroll,
+            Data,
+            StatusRead,
+            DataRead,
+            Dma,
+        };
+
+        PPUTrace();
+        void begin();
+        void record(Kind kind, uint8_t value = 0);
+        void record_dma(const uint8_t* page);
+        // steps ppu through the recorded frame until its picture is done, false on a malformed trace
+        static bool replay(PPU& ppu, const uint8_t* events, std::size_t size);
+
+        uint32_t m_dot;         // PPU steps since begin()
+        uint32_t m_lastDot;     // of the last event
+        uint32_t m_count;
+        bool m_pictureDone;     // the PPU reached post-render, nothing later is recorded
+        std::vector<uint8_t> m_events;
+    };
+
+    // p2: renders semantic frames with its own copy of the cartridge
+    struct StateRenderer
+    {
+        bool load(const std::string& rom);
+        bool render(const PPUSnapshot& start, const uint8_t* events, std::size_t size, uint8_t* matrix);
+
+        Console m_console;
+    };
+}
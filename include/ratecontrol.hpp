@@ -0,0 +1,62 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+namespace NESemu
+{
+    // p2 reports this often while receiving
+    const int ReportIntervalMs = 200;
+    // p1 backs off above either of these
+    const double CongestedLoss = 0.02;
+    const int CongestedDelayUs = 20000;
+    // p2 only reports what arrived, this long without a report counts as total loss
+    const int ReportSilenceMs = 5 * ReportIntervalMs;
+
+    /*
+    Adaptive screen rate, p1 side
+
+    p2 reports the share of screen datagrams it lost and how long they queued
+    (transit time above the lowest seen recently, so the clocks need not agree).
+    Each report past a limit moves one level down the ladder below, at most once
+    per HoldMs so the last step shows in the reports first; two seconds of clean
+    reports move one level back up. A step up that congests again soon doubles
+    the clean time needed for the next one, so the level settles instead of
+    oscillating around the link's capacity. Latency stays bounded because a congested
+    link gets fewer, smaller, evenly spaced datagrams instead of queueing them.
+
+    level 0: as configured
+    level 1: datagrams paced across half a frame instead of one burst
+    level 2: delta and packed codec, whatever the options
+    level 3: periodic keyframes 4 times rarer
+    level 4-6: 30, 20, 15 frames per second
+    */
+    struct RateControl
+    {
+        static constexpr int MaxLevel = 6;
+        static constexpr int HoldMs = 2 * ReportIntervalMs;
+        static constexpr int ClearReports = 2000 / ReportIntervalMs;
+        static constexpr int MaxBackoff = 16;
+
+        RateControl();
+        // true when the level changed
+        bool report(double loss, uint32_t queueDelayUs, std::chrono::steady_clock::time_point now);
+        // true when the level changed because reports stopped
+        bool checkSilence(std::chrono::steady_clock::time_point now);
+        // counts emulated frames, false for the ones not to send
+        bool sendThis();
+
+        bool paced() const { return m_level >= 1; }
+        bool dense() const { return m_level >= 2; }
+        int keyframeScale() const { return m_level >= 3 ? 4 : 1; }
+        int frameDivisor() const { return m_level >= 4 ? m_level - 2 : 1; }
+
+        bool m_enabled;
+        int m_level;
+        int m_clearReports;
+        int m_backoff;          // ClearReports multiplier
+        bool m_probing;         // last change was a step up
+        uint32_t m_frames;
+        std::chrono::steady_clock::time_point m_lastChange;
+        std::chrono::steady_clock::time_point m_lastReport;    // epoch until the first one
+    };
+}
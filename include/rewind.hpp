@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include "controller.hpp"
+#include "metrics.hpp"
+
+namespace NESemu
+{
+    struct NES;
+
+    const int RewindKeyInterval = 60;   // snapshots per keyframe
+    const int RewindStep = 2;           // frames back per displayed frame while rewinding
+    const int MaxRewindInterval = 60;
+
+    /*
+    Rewind buffer
+
+    Every m_interval frames the machine is saved in the save state layout
+    and stored as the XOR with the previous snapshot, run-length coded:
+    frame to frame most of RAM, VRAM and OAM stays the same, so a delta is
+    mostly one zero run. Every RewindKeyInterval snapshots one is stored
+    against zeros instead, a keyframe. The input of every frame is kept as
+    well. When the buffer is over budget the oldest keyframe goes with its
+    deltas.
+
+    seek() restores the newest snapshot at or before a frame, from its
+    keyframe and the deltas after it, and re-simulates the frames up to the
+    one asked for with the recorded inputs.
+
+    Delta: (zero run varint, literal count varint, XOR bytes) repeated
+    */
+    struct Rewind
+    {
+        Rewind(NES& nes);
+        void start(std::size_t budgetBytes, int interval);
+        // after each live frame
+        void record();
+        // the machine as it was after frame, or after the oldest one kept; newer history is discarded
+        void seek(uint32_t frame);
+        void report();
+
+        struct Entry
+        {
+            uint32_t m_frame;
+            bool m_key;
+            std::vector<uint8_t> m_data;
+        };
+
+        NES& m_nes;
+        bool m_enabled;
+        std::size_t m_budget;
+        int m_interval;
+        uint32_t m_frame;                   // last frame emulated
+        std::deque<Entry> m_entries;        // oldest first
+        std::deque<uint16_t> m_inputs;      // controller 1 and 2 of each frame from m_inputBase on
+        uint32_t m_inputBase;
+        std::size_t m_bytes;                // entries and inputs
+        int m_sinceKey;
+        std::vector<uint8_t> m_last;        // state of the newest entry
+        std::vector<uint8_t> m_state;       // scratch
+        NetController m_ports[2];           // replay inputs while re-simulating
+
+        uint32_t m_statFrames;
+        uint64_t m_statKeyBytes;
+        uint64_t m_statDeltaBytes;
+        uint32_t m_statKeys;
+        uint32_t m_statDeltas;
+        Histogram m_snapshotTime;           // us
+        Histogram m_seekTime;               // us
+    };
+}
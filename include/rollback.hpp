@@ -0,0 +1,83 @@
+#pragma once
+#include <chrono>
+#include <vector>
+#include "controller.hpp"
+#include "statehash.hpp"
+#include "state.hpp"
+
+namespace NESemu
+{
+    struct NES;
+
+    const int MaxRollback = 8;      // frames we may run ahead of the last confirmed remote input
+    const int MaxInputDelay = 16;
+    // inputs stay in flight for at most about 2 * MaxInputDelay + MaxRollback frames
+    const int InputRing = 128;
+
+    /*
+    Rollback netplay
+
+    Both peers run the game. p1 is controller 1, p2 is controller 2.
+    Only inputs travel, as (first frame, inputs...) ranges covering everything
+    the peer has not confirmed yet, so a lost packet is repaired by the next one.
+    A frame whose remote input is unknown runs with a prediction (the last
+    confirmed input). When the real input differs, the machine is restored to
+    the snapshot taken before that frame and re-simulated up to the present.
+    Local inputs are applied m_inputDelay frames after they are read, which
+    trades a little latency for fewer rollbacks.
+
+    Each frame starts by hashing the machine. Once no rollback can change
+    that state any more, its hash goes to the peer with the inputs, and the
+    first frame whose hashes differ is reported as a desync.
+    */
+    struct Rollback
+    {
+        Rollback(NES& nes);
+        void start(int inputDelay);
+        void update();
+
+        // written: this update's local input is in m_localInput, a stall has none
+        void send_inputs(bool written);
+        void receive_inputs();
+        void run_frame(int frame);
+        // newest frame whose starting state no rollback can change
+        int final_frame() const;
+        void check_hash();
+
+        NES& m_nes;
+        bool m_enabled;
+        int m_inputDelay;
+        int m_local;    // port index of this peer
+
+        // both ports read inputs set per frame, so re-simulation is deterministic
+        NetController m_ports[2];
+
+        int m_frame;            // next frame to simulate
+        int m_remoteConfirmed;  // all remote inputs up to here are known
+        int m_peerConfirmed;    // the peer has all our inputs up to here
+        int m_rollbackFrom;     // earliest mispredicted frame, or -1
+        uint8_t m_localInput[InputRing];
+        uint8_t m_remoteInput[InputRing];
+        uint8_t m_predicted[InputRing];
+        std::vector<Snapshot> m_snapshots; // state at the start of a frame, by frame % size
+
+        // desync detection
+        StateHash m_hasher;
+        uint64_t m_hashes[InputRing];   // of the state at the start of a frame
+        int m_peerHashFrames[InputRing];    // frame of each final hash the peer sent
+        uint64_t m_peerHashes[InputRing];
+        int m_peerHashNewest;               // -1 before the first
+        int m_checked;                      // newest frame compared or passed over
+        int m_lastMatched;                  // newest frame both sides hashed the same, or -1
+        bool m_desynced;
+
+        // report
+        uint32_t m_statFrames;
+        uint32_t m_statRollbacks;
+        uint32_t m_statResimulated;
+        uint32_t m_statStalls;
+        std::chrono::high_resolution_clock::duration m_statSave;
+        std::chrono::high_resolution_clock::duration m_statLoad;
+        std::chrono::high_resolution_clock::duration m_statHash;
+    };
+}
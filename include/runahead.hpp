@@ -0,0 +1,68 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include "console.hpp"
+#include "metrics.hpp"
+#include "state.hpp"
+
+namespace NESemu
+{
+    struct NES;
+
+    const int MaxRunAhead = 8;
+
+    /*
+    Run-ahead for p1
+
+    After each live frame the machine is run m_frames further with the
+    inputs of that frame and the last of those frames is the one shown, so
+    a press shows up as many frames earlier as the game itself takes to
+    react to it. p2, the spectators and the rewind buffer still get the
+    live frames, and the machine goes on from the live state.
+
+    The frames ahead run on a Console of our own loaded from the same ROM,
+    from a save of the live machine, so nothing has to be restored and only
+    the last picture reaches the window. Serially that happens in finish().
+    With a second core begin() hands the state and the inputs to a worker
+    while this thread sends the live frame, and finish() waits for its
+    picture.
+    */
+    struct RunAhead
+    {
+        RunAhead(NES& nes);
+        ~RunAhead();
+        // false when the ROM does not load
+        bool start(int frames, bool threaded);
+        void stop();
+        // right after the live frame is emulated
+        void begin();
+        // before the frame is drawn or captured: the picture frames ahead goes on the screen
+        void finish();
+        // m_frames from m_state with m_inputs, on m_console
+        void run();
+        void worker();
+        void report();
+
+        NES& m_nes;
+        bool m_enabled;
+        int m_frames;
+        Console m_console;
+        Snapshot m_state;
+        uint8_t m_inputs[2];        // the live frame's controller 1 and 2
+
+        // threaded
+        std::mutex m_lock;
+        std::condition_variable m_wake;
+        std::condition_variable m_done;
+        bool m_pending;             // m_state is waiting for the worker
+        bool m_running;
+        uint32_t m_workerUs;        // of the last job
+        std::thread m_thread;
+
+        uint32_t m_statFrames;
+        Histogram m_cost;           // CPU spent on run-ahead per frame, both threads, us
+        Histogram m_wait;           // threaded: this thread waiting for the worker, us
+    };
+}
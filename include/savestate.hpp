@@ -0,0 +1,67 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cartridge.hpp"
+#include "state.hpp"
+
+namespace NESemu
+{
+    const uint32_t SaveStateMagic = 0x4e455373;     // "NESs"
+    const uint16_t SaveStateVersion = 1;
+
+    /*
+    Save state file, every field at a fixed offset, multi-byte values big-endian
+
+    header       magic u32, version u16, mapper u8, reserved u8, ROM hash u32,
+                 cartridge RAM size u32 (0: mapper 0 has no writable state)
+    CPU          PC u16, SP A X Y flags, skip cycles i32, cycles i32, RAM 2 KB
+    PPU          put_ppu_state()
+    controllers  2 x (strobe u8, shift register u32, network state u32)
+    cartridge    RAM, the size from the header
+
+    A state only loads into the ROM it was saved from and with the same
+    version; a new field means a new version, never a moved one.
+    */
+    const int SaveStateHeaderSize = 16;
+    const int CPUStateSize = 2 + 5 + 4 + 4 + 0x800;
+    const int ControllerStateSize = 1 + 4 + 4;
+    extern const int SaveStateSize;
+
+    // FNV-1a over PRG and CHR ROM
+    uint32_t rom_hash(const Cartridge& cartridge);
+
+    // p must have room for SaveStateSize bytes
+    void put_save_state(uint8_t* p, const Snapshot& s, uint32_t romHash);
+    // false, with the reason in error, when the data is not a state for this ROM and version
+    bool get_save_state(const uint8_t* p, std::size_t size, uint32_t romHash, Snapshot& s, std::string& error);
+
+    bool read_state_file(const std::string& path, std::vector<uint8_t>& data);
+
+    // Writes save states to disk on a worker thread; a state saved while the previous one is still being
+    // written replaces the one waiting. Each file is written beside its name and renamed over it, so a
+    // crash leaves the old state or the new one, never half of each.
+    struct StateWriter
+    {
+        StateWriter();
+        ~StateWriter();
+
+        void write(const std::string& path, const uint8_t* data, std::size_t size);
+        // returns once everything queued is on disk
+        void stop();
+
+        void worker();
+
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::thread m_thread;
+        bool m_running;
+        bool m_pending;
+        std::string m_path;
+        std::vector<uint8_t> m_data;        // waiting, under m_mutex
+        std::vector<uint8_t> m_writing;     // worker only
+    };
+}
@@ -1,19 +1,30 @@
 #pragma once
 #include <SFML/Graphics.hpp>
 #include <array>
+#include <cstdint>
 
 namespace NESemu
 {
+    const int ScreenWidth = 256;
+    const int ScreenHeight = 240;
+    const int ScreenSize = ScreenWidth * ScreenHeight;
+
+    // NES palette index -> RGBA (0xRRGGBBAA)
+    extern const std::uint32_t colormap[64];
+
     struct Screen : public sf::Drawable
     {
         void create (unsigned int width, unsigned int height, float pixel_size, sf::Color color);
         void setPixel (std::size_t x, std::size_t y, uint8_t palette_color);
+        // row-major (y*256 + x) palette indices, one scanline after another
+        void setFrame (const uint8_t* frame);
+        void refresh ();
         void draw(sf::RenderTarget& target, sf::RenderStates states) const;
 
         sf::Vector2u m_screenSize;
         float m_pixelSize; //virtual pixel size in real pixels
         sf::VertexArray m_vertices;
 
-        uint8_t m_screen_matrix[256*240];
+        uint8_t m_screen_matrix[256*240]; // row-major: [y*256 + x]
     };
 };
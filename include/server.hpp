@@ -0,0 +1,147 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "console.hpp"
+#include "netplug.hpp"
+
+namespace NESemu
+{
+    const int MaxSessions = 1024;
+    const int SessionTimeoutMs = 10000;
+    const int ServerStatMs = 5000;
+
+    struct ServerOptions
+    {
+        bool m_delta;
+        bool m_pack;
+        int m_fecGroup;
+        bool m_adaptive;
+    };
+
+    // one game: a console and up to two remote players, each streamed its own screen
+    struct Session
+    {
+        Session(uint32_t id, const ServerOptions& options);
+        // network thread: the player's first join binds the slot to its address
+        bool join(int player, const Transport& socket, uint32_t addr, uint16_t port);
+        bool isFrom(int player, uint32_t addr, uint16_t port) const;
+        // a worker, never two at once for the same session
+        void run_frame();
+
+        uint32_t m_id;
+        Console m_console;
+        std::unique_ptr<Netplug> m_players[2];
+        std::atomic<bool> m_joined[2];
+        uint32_t m_addr[2];
+        uint16_t m_port[2];
+        std::atomic<int64_t> m_lastSeen;    // steady clock, ms
+
+        // scheduler
+        Clock::time_point m_deadline;
+        Clock::time_point m_due;            // deadline of the job in flight
+        std::atomic<bool> m_running;        // a frame job is queued or running
+        std::atomic<bool> m_closed;
+        int m_home;                         // worker queue it is submitted to
+    };
+
+    /*
+    Work-stealing pool for frame jobs
+
+    Every worker has its own queue and the scheduler spreads sessions over them,
+    so a session's frames usually run on the same thread. A worker runs the
+    oldest job of its own queue; when that is empty it takes the newest job of
+    another worker's, so one slow session never holds up the frames queued
+    behind it while other threads are idle. The queues are short and each is
+    locked by its owner and the occasional thief only, so the locks are rarely
+    contended.
+    */
+    struct WorkerPool
+    {
+        using Job = std::shared_ptr<Session>;
+
+        WorkerPool();
+        ~WorkerPool();
+        void start(int threads);
+        void stop();
+        void submit(Job job, int home);
+        void work(int index);
+        Job take(int index);
+
+        struct Queue
+        {
+            std::mutex m_lock;
+            std::deque<Job> m_jobs;
+        };
+        std::vector<std::unique_ptr<Queue>> m_queues;
+        std::vector<std::thread> m_threads;
+        std::mutex m_idleLock;
+        std::condition_variable m_idle;
+        int m_pending;      // jobs queued, under m_idleLock
+        bool m_stopping;
+
+        std::atomic<uint64_t> m_statJobs;
+        std::atomic<uint64_t> m_statSteals;
+        std::atomic<uint64_t> m_statBusyUs;
+        std::atomic<uint64_t> m_statLateUs;     // from a job's deadline to it starting
+    };
+
+    /*
+    Multi-session server
+
+    Hosts any number of independent games in one process on one UDP port.
+    Clients are ordinary p2s started with --session: every datagram they send
+    carries a session header (id, player) and the network thread hands it to
+    that player's Netplug, which sends back through the same socket. A join
+    for an unknown id creates the session with the requested ROM. The
+    scheduler gives each session a 60fps deadline and submits its frame job
+    to the pool when due; a session whose previous frame is still running
+    skips a frame rather than queueing up. Sessions all of whose players have
+    been silent for SessionTimeoutMs are closed.
+    */
+    struct Server
+    {
+        Server(unsigned short port, int threads, const std::vector<std::string>& roms, const ServerOptions& options);
+        ~Server();
+        bool run();
+        void stop() { m_running = false; }
+
+        void receive_loop();
+        void demux(const Datagram& datagram);
+        void schedule(Clock::time_point now);
+        void report(Clock::time_point now);
+
+        unsigned short m_port;
+        int m_threads;
+        std::vector<std::string> m_roms;
+        ServerOptions m_options;
+        std::atomic<bool> m_running;
+
+        Transport m_transport;
+        WorkerPool m_pool;
+        std::thread m_receiver;
+
+        // network thread
+        std::unordered_map<uint32_t, std::shared_ptr<Session>> m_byId;
+        // handed to the scheduler
+        std::mutex m_newLock;
+        std::vector<std::shared_ptr<Session>> m_new;
+        // scheduler
+        std::vector<std::shared_ptr<Session>> m_sessions;
+        int m_nextHome;
+
+        Clock::time_point m_lastStat;
+        uint64_t m_statFrames;
+        uint64_t m_statSkipped;
+        uint64_t m_lastJobs;
+        uint64_t m_lastSteals;
+        uint64_t m_lastBusyUs;
+        uint64_t m_lastLateUs;
+    };
+}
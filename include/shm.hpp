@@ -0,0 +1,128 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "metrics.hpp"
+#include "screen.hpp"
+
+namespace NESemu
+{
+    const uint32_t ShmMagic = 0x4e45536d;   // "NESm"
+    const uint32_t ShmVersion = 1;
+    const int ShmSlots = 4;
+    const int ShmReadTries = 4;
+
+    // one frame, written under its seqlock: m_seq is odd while the writer is in it
+    struct alignas(64) ShmFrame
+    {
+        std::atomic<uint32_t> m_seq;
+        uint32_t m_frame;
+        uint32_t m_time;        // timestamp_us() when published, the clock is shared on one host
+        uint32_t m_input;       // last p2 input applied before it was emulated
+        uint8_t m_pixels[ScreenSize];
+    };
+
+    // p2's newest controller state, latest wins
+    struct alignas(64) ShmInput
+    {
+        std::atomic<uint32_t> m_seq;
+        uint32_t m_input;
+        uint8_t m_state;
+        uint32_t m_displayed;   // frame on p2's screen when it was read
+        uint32_t m_time;
+    };
+
+    struct ShmLayout
+    {
+        std::atomic<uint32_t> m_magic;      // set by p1 once the rest is initialised
+        uint32_t m_version;
+        std::atomic<uint32_t> m_latest;     // newest complete frame, 0 before the first
+        ShmInput m_input;
+        ShmFrame m_frames[ShmSlots];
+    };
+
+    /*
+    Shared-memory link for p1 and p2 on the same host
+
+    Replaces the UDP path with a file mapped from /dev/shm: p1 writes each
+    frame into a ring of ShmSlots slots and p2 writes its controller state
+    into a mailbox. Every slot is a seqlock, so writers never wait for
+    readers and readers never block the writer; a reader that raced the
+    writer sees the sequence change and reads again. A frame is copied out
+    of its slot and only used once the sequence shows the copy whole, so a
+    torn frame never reaches the screen. Any number of local readers (a p2, a
+    recorder) may attach; only p2 writes inputs. p1 creates the file and
+    removes its name on exit.
+    */
+    struct SharedLink
+    {
+        SharedLink();
+        ~SharedLink();
+
+        // writer: p1, initialises the layout; otherwise attaches to what p1 created or will create
+        bool open(const std::string& name, bool writer);
+        void close();
+        bool isOpen() const { return m_layout != nullptr; }
+
+        // p1
+        void publish(const uint8_t* matrix, uint32_t input);
+        // the newest input since the last call, false when there is none
+        bool read_input(uint8_t& state, uint32_t& input);
+
+        // p2
+        void write_input(uint8_t state);
+        // calls use(pixels, frame, input) on a copy of the newest frame if it is not newerThan, once the
+        // copy is known not to be torn; false when there is none or the writer kept overtaking us
+        template <typename Use>
+        bool view_frame(uint32_t newerThan, Use use);
+        void viewed(uint32_t frame, uint32_t newerThan, uint32_t time);
+        void report(const char* what);
+
+        std::string m_path;
+        bool m_writer;
+        int m_fd;
+        ShmLayout* m_layout;
+        uint32_t m_frame;           // p1: last published
+        uint32_t m_inputSeq;        // p2: last written, p1: last read
+        uint32_t m_displayed;       // p2: last frame viewed
+        std::vector<uint8_t> m_view; // p2: the frame being read, out of the writer's way
+
+        uint32_t m_statFrames;
+        uint32_t m_statRetries;     // p2: reads repeated because the writer was in the slot
+        uint32_t m_statSkipped;     // p1: inputs overwritten before we read them, p2: frames never viewed
+        Histogram m_age;            // p1: input age, p2: frame age, in us
+    };
+
+    template <typename Use>
+    bool SharedLink::view_frame(uint32_t newerThan, Use use)
+    {
+        if (!m_layout || m_layout->m_magic.load(std::memory_order_acquire) != ShmMagic)
+            return false;
+        for (int attempt = 0; attempt < ShmReadTries; ++attempt)
+        {
+            uint32_t latest = m_layout->m_latest.load(std::memory_order_acquire);
+            // behind newerThan only when p1 was restarted
+            if (!latest || latest == newerThan)
+                return false;
+            const ShmFrame& slot = m_layout->m_frames[latest % ShmSlots];
+            uint32_t seq = slot.m_seq.load(std::memory_order_acquire);
+            if (!(seq & 1) && slot.m_frame == latest)
+            {
+                uint32_t time = slot.m_time;
+                uint32_t input = slot.m_input;
+                std::memcpy(m_view.data(), slot.m_pixels, ScreenSize);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.m_seq.load(std::memory_order_relaxed) == seq)
+                {
+                    use(m_view.data(), latest, input);
+                    viewed(latest, newerThan, time);
+                    return true;
+                }
+            }
+            ++m_statRetries;
+        }
+        return false;
+    }
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <deque>
+#include <vector>
+#include "netplug.hpp"
+
+namespace NESemu
+{
+    const int MaxViewers = 64;
+    const int ViewerTimeoutMs = 3 * SpectatorJoinMs;
+    const int ViewerQueueFrames = 3;    // frames waiting for one viewer before it is resynced with a keyframe
+    const int KeyRetryFrames = 30;      // at most one recovery keyframe per viewer this often
+    const int SharedFrames = 8;
+    const int MaxFanoutDatagrams = 2048; // per frame, the rest waits in the viewer queues
+
+    // one encoded frame, sent to any number of viewers
+    struct SharedFrame
+    {
+        uint32_t m_frame;
+        uint8_t m_type;
+        uint32_t m_base;
+        uint16_t m_chunks;
+        uint32_t m_time;
+        uint32_t m_input;
+        std::vector<uint8_t> m_payload;
+        int m_fecGroup;                 // as p2's stream, 0 = no parity
+        std::vector<uint8_t> m_parity;  // ChunkSize per group of chunks, their XOR
+    };
+
+    struct Viewer
+    {
+        struct Pending
+        {
+            const SharedFrame* m_shared;
+            uint32_t m_frame;   // m_shared may have been reused since
+            uint16_t m_chunk;   // next chunk to send
+        };
+
+        uint32_t m_addr;
+        uint16_t m_port;
+        Clock::time_point m_lastSeen;
+        uint32_t m_ackFrame;
+        uint32_t m_keyFrame;    // newest keyframe queued for it
+        bool m_needKey;
+        std::deque<Pending> m_queue;
+    };
+
+    /*
+    Spectator fan-out
+
+    p1 sends every frame of its screen stream, already encoded for p2, to the
+    viewers registered on a second port as well. The encoded bytes are copied
+    once into a shared ring and every viewer's queue points into it, so adding
+    viewers adds datagrams but no encoding. A viewer that joins, or falls too far
+    behind to decode p2's deltas, is queued a keyframe instead; that keyframe is
+    encoded at most once per frame, whatever the number of viewers needing it.
+    Viewers are served a chunk at a time in turn so nobody waits for a whole
+    frame of everybody else. With FEC on, each group's parity is computed
+    once per frame as well and follows its last chunk to every viewer.
+    */
+    struct Spectators
+    {
+        Spectators();
+
+        bool open(unsigned short port);
+        bool isOpen() const { return m_open; }
+        // after netplug.send_screen
+        void send_frame(const Netplug& netplug, const uint8_t* matrix);
+
+        void poll(Clock::time_point now);
+        const SharedFrame* keyframe(const Netplug& netplug, const uint8_t* matrix);
+        void pump();
+
+        bool m_open;
+        Transport m_transport;
+        std::vector<Viewer> m_viewers;
+        std::size_t m_next;     // viewer served first by the next pump
+        SharedFrame m_frames[SharedFrames];
+        SharedFrame m_key;
+        FrameCodec m_codec;
+
+        uint32_t m_statFrames;
+        uint32_t m_statKeyframes;
+        uint32_t m_statResyncs;
+        uint64_t m_statDatagrams;
+        Clock::duration m_statTime;
+    };
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+
+namespace NESemu
+{
+    /*
+    Plain copies of the mutable machine state, no pointers or vectors,
+    so a whole Snapshot is one flat block that can be copied around freely.
+    The cartridge is not included: mapper 0 has no writable state.
+    */
+    struct CPUSnapshot
+    {
+        uint16_t r_PC;
+        uint8_t r_SP, r_A, r_X, r_Y;
+        uint8_t flags; // N V - - D I Z C
+        int32_t m_skipCycles;
+        int32_t m_cycles;
+        uint8_t m_RAM[0x800];
+    };
+
+    struct PPUSnapshot
+    {
+        uint8_t m_RAM[0x800];
+        uint8_t m_palette[0x20];
+        uint8_t m_spriteMemory[64 * 4];
+        uint8_t m_scanlineSprites[8];
+        uint8_t m_scanlineSpriteCount;
+
+        uint8_t m_pipelineState;
+        int32_t m_cycle;
+        int32_t m_scanline;
+        uint16_t m_dataAddress;
+        uint16_t m_tempAddress;
+        uint16_t m_dataAddrIncrement;
+        uint8_t m_fineXScroll;
+        uint8_t m_dataBuffer;
+        uint8_t m_spriteDataAddress;
+        uint8_t m_bgPage, m_sprPage;
+        // m_evenFrame, m_vblank, m_sprZeroHit, m_firstWrite, m_longSprites, m_generateInterrupt,
+        // m_greyscaleMode, m_showSprites, m_showBackground, m_hideEdgeSprites, m_hideEdgeBackground
+        uint16_t flags;
+    };
+
+    struct ControllerSnapshot
+    {
+        uint8_t m_flag;
+        uint32_t m_keyStates;
+        uint32_t m_netKeyState;
+    };
+
+    struct Snapshot
+    {
+        CPUSnapshot cpu;
+        PPUSnapshot ppu;
+        ControllerSnapshot controller[2];
+    };
+}
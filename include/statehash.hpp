@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace NESemu
+{
+    struct CPU;
+    struct PPU;
+
+    // XXH64
+    uint64_t xxh64(const uint8_t* data, std::size_t size, uint64_t seed = 0);
+
+    const int HashPageSize = 0x100;
+    // CPU RAM, PPU RAM, OAM, palette
+    const int HashPages = 8 + 8 + 1 + 1;
+
+    /*
+    Hash of the machine state that matters for desyncs: CPU registers and
+    RAM, PPU RAM, OAM and the palette.
+
+    Memory is hashed a 256-byte page at a time and the page hashes are
+    kept; CPU and PPU mark the pages they write (m_dirtyPages, m_dirty),
+    so a frame only rehashes what it wrote. Loading a state marks
+    everything. The result is the hash of the page hashes and registers.
+    */
+    struct StateHash
+    {
+        StateHash();
+        uint64_t update(CPU& cpu, PPU& ppu);
+
+        uint64_t m_pages[HashPages];
+        uint64_t m_statPages;   // rehashed
+        uint64_t m_statCalls;
+    };
+}
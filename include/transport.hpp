@@ -0,0 +1,163 @@
+#pragma once
+#include <SFML/Network.hpp>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+namespace NESemu
+{
+    // largest UDP payload that fits a 1500 byte ethernet frame
+    const int MaxDatagram = 1472;
+    // datagrams per sendmmsg / recvmmsg, a whole raw frame is 49
+    const int DatagramBatch = 64;
+    // datagrams waiting for an attached transport, beyond this they are dropped
+    const int MaxInbox = 256;
+    const int MaxPrefix = 8;
+
+    struct Datagram
+    {
+        uint16_t m_size;    // 0: received from someone other than the peer
+        uint32_t m_addr;    // sender on receive, destination on send (host byte order)
+        uint16_t m_port;
+        uint8_t m_data[MaxDatagram];
+    };
+
+    // network conditions simulated on the receiving side of a Transport
+    struct Shaping
+    {
+        double m_delayMs;
+        double m_jitterMs;      // extra delay, uniform in [0, m_jitterMs]
+        double m_loss;          // fractions of received datagrams
+        double m_duplicate;
+        double m_reorder;       // held back behind the ones after it
+        double m_rateKbps;      // bottleneck, datagrams queue behind each other; 0 = unlimited
+        bool active() const
+        {
+            return m_delayMs > 0 || m_jitterMs > 0 || m_loss > 0 || m_duplicate > 0 || m_reorder > 0 || m_rateKbps > 0;
+        }
+    };
+    // a full bottleneck queue drops what arrives
+    const int BottleneckQueueMs = 200;
+    // "delay_ms,jitter_ms,loss%,duplicate%,reorder%,rate_kbps", trailing fields may be left out
+    bool parse_shaping(const std::string& text, Shaping& shaping);
+
+    struct HeldDatagram
+    {
+        int64_t m_due;      // steady clock, us
+        uint64_t m_order;   // arrival, so equal due times keep their order
+        Datagram m_datagram;
+    };
+
+    // network byte order, same as sf::Packet
+    inline uint8_t* put16(uint8_t* p, uint16_t v) { p[0] = v >> 8; p[1] = v; return p + 2; }
+    inline uint8_t* put32(uint8_t* p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; return p + 4; }
+    inline uint16_t get16(const uint8_t* p) { return uint16_t(p[0] << 8 | p[1]); }
+    inline uint32_t get32(const uint8_t* p) { return uint32_t(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3]; }
+
+    // Non-blocking UDP with one peer, or with anyone when opened without one.
+    // Outgoing datagrams are written in place into a preallocated batch and sent together,
+    // incoming ones are read a batch at a time. On Linux that is one sendmmsg / recvmmsg
+    // per batch; elsewhere, or with native = false, each datagram goes through sf::UdpSocket.
+    struct Transport
+    {
+        Transport();
+        ~Transport();
+
+        bool open(unsigned short port, const std::string& peer, unsigned short peerPort, bool native = true);
+        void close();
+        bool isNative() const { return m_fd >= 0; }
+
+        // buffer for the next outgoing datagram, queued by push(size) to the peer or push(size, addr, port)
+        uint8_t* datagram();
+        void push(std::size_t size);
+        void push(std::size_t size, uint32_t addr, uint16_t port);
+        void flush();
+        // one datagram, bypassing the batch, so another thread may use it while the batch user runs
+        void send(const uint8_t* data, std::size_t size);
+
+        bool lose();
+
+        // waits until something can be received, at most timeoutUs
+        bool wait(int64_t timeoutUs);
+        // reads what is queued into m_in without blocking, returns the number of datagrams
+        int receive();
+
+        // from now on, received datagrams go through the simulated network first
+        void shape(const Shaping& shaping) { m_shaping = shaping; }
+
+        // every outgoing datagram starts with these bytes, e.g. a session header
+        void setPrefix(const uint8_t* prefix, std::size_t size);
+        // no socket of its own: sends through owner's to addr:port, which several threads may do at
+        // once, and receives only what the owner's reader hands over with deliver(). Native only.
+        bool attach(const Transport& owner, uint32_t addr, uint16_t port);
+        bool isAttached() const { return m_attached; }
+        // the datagram from byte offset on, called by the thread reading the owner
+        void deliver(const Datagram& datagram, std::size_t offset);
+        void setup_batches();
+        bool waitSocket(int64_t timeoutUs);
+        int receiveSocket();
+        void hold(const Datagram& datagram, int64_t now);
+
+        Datagram m_out[DatagramBatch];
+        int m_outCount;
+        Datagram m_in[DatagramBatch];
+        int m_inCount;
+
+        std::atomic<uint64_t> m_statSyscalls;
+        std::atomic<uint64_t> m_statSent;
+        std::atomic<uint64_t> m_statBytes;  // sent
+        std::atomic<uint64_t> m_statReceived;
+
+        // loss simulation: this fraction of outgoing datagrams is dropped instead of sent
+        double m_sendLoss;
+        std::atomic<uint64_t> m_statLost;
+
+        // receive shaping, datagrams in flight ordered by due time (a heap)
+        Shaping m_shaping;
+        std::vector<HeldDatagram> m_held;
+        uint64_t m_heldOrder;
+        int64_t m_linkFree;         // when the bottleneck is done with what it holds
+        std::minstd_rand m_random;
+        uint64_t m_statShapedLost;
+        uint64_t m_statQueueDrops;
+        uint64_t m_statDuplicated;
+        uint64_t m_statReordered;
+
+        uint8_t m_prefix[MaxPrefix];
+        std::size_t m_prefixSize;
+        bool m_attached;
+        std::mutex m_inboxLock;
+        std::deque<Datagram> m_inbox;
+        uint64_t m_statInboxDrops;
+
+        // fallback
+        sf::UdpSocket m_socket;
+        sf::SocketSelector m_selector;
+        sf::IpAddress m_peerAddr;
+        unsigned short m_peerPort;
+        bool m_anySource;
+
+        // native
+        int m_fd;
+#ifdef __linux__
+        sockaddr_in m_peer;
+        sockaddr_in m_outAddr[DatagramBatch];
+        sockaddr_in m_inAddr[DatagramBatch];
+        iovec m_outIov[DatagramBatch];
+        iovec m_inIov[DatagramBatch];
+        mmsghdr m_outMsg[DatagramBatch];
+        mmsghdr m_inMsg[DatagramBatch];
+#endif
+    };
+
+    // sends raw-frame sized bursts over loopback with both paths and prints packets/s and CPU time per frame
+    void transport_benchmark(unsigned short port, int frames = 600);
+}
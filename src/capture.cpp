@@ -0,0 +1,166 @@
+#include "capture.hpp"
+#include "screen.hpp"
+#include <SFML/Graphics.hpp>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+namespace NESemu
+{
+    Capture::Capture() :
+        m_format(Raw),
+        m_dropFrames(true),
+        m_slots(0),
+        m_head(0),
+        m_tail(0),
+        m_running(false),
+        m_pushed(0),
+        m_written(0),
+        m_dropped(0)
+    {}
+
+    Capture::~Capture()
+    {
+        close();
+    }
+
+    bool Capture::open(std::string path, Format format, bool dropFrames, std::size_t slots)
+    {
+        close();
+
+        m_path = path;
+        m_format = format;
+        m_dropFrames = dropFrames;
+        if (m_format != PNG)
+        {
+            m_file.open(m_path, std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+            if (!m_file)
+            {
+                std::cerr << "capture: open failed... " << m_path << std::endl;
+                return false;
+            }
+        }
+        if (m_format == Y4M)
+            m_file << "YUV4MPEG2 W" << CaptureWidth << " H" << CaptureHeight << " F60:1 Ip A1:1 C444\n";
+
+        // +1 so that head == tail always means empty
+        m_slots = slots + 1;
+        m_ring.assign(m_slots * CaptureFrameSize, 0);
+        m_convert.assign(CaptureFrameSize * 4, 0);
+        m_head = m_tail = 0;
+        m_pushed = m_written = m_dropped = 0;
+
+        m_running = true;
+        m_thread = std::thread(&Capture::worker, this);
+        std::cout << "capture: " << m_path << std::endl;
+        return true;
+    }
+
+    void Capture::close()
+    {
+        if (!m_running)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_running = false;
+        }
+        m_notEmpty.notify_one();
+        m_thread.join();
+        m_file.close();
+        std::cout << "capture: " << m_written << " frames written, "
+                  << m_dropped << " dropped" << std::endl;
+    }
+
+    void Capture::push(const uint8_t* frame)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        ++m_pushed;
+        if ((m_head + 1) % m_slots == m_tail)
+        {
+            if (m_dropFrames)
+            {
+                ++m_dropped;
+                return;
+            }
+            // back-pressure: hold the emulation until the writer frees a slot
+            m_notFull.wait(lock, [this]{ return (m_head + 1) % m_slots != m_tail; });
+        }
+        // the slot is not visible to the worker until m_head moves, so copy it unlocked
+        auto slot = m_head;
+        lock.unlock();
+        std::memcpy(&m_ring[slot * CaptureFrameSize], frame, CaptureFrameSize);
+        lock.lock();
+        m_head = (slot + 1) % m_slots;
+        lock.unlock();
+        m_notEmpty.notify_one();
+    }
+
+    void Capture::worker()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            m_notEmpty.wait(lock, [this]{ return m_head != m_tail || !m_running; });
+            if (m_head == m_tail) // stopped and drained
+                break;
+
+            auto slot = m_tail;
+            lock.unlock();
+            writeFrame(&m_ring[slot * CaptureFrameSize]);
+            ++m_written;
+            lock.lock();
+            m_tail = (slot + 1) % m_slots;
+            m_notFull.notify_one();
+        }
+    }
+
+    void Capture::writeFrame(const uint8_t* frame)
+    {
+        switch (m_format)
+        {
+            case Raw:
+            case PNG:
+            {
+                for (int i = 0; i < CaptureFrameSize; ++i)
+                {
+                    auto rgba = colormap[frame[i] & 0x3f];
+                    m_convert[i * 4 + 0] = rgba >> 24;
+                    m_convert[i * 4 + 1] = rgba >> 16;
+                    m_convert[i * 4 + 2] = rgba >> 8;
+                    m_convert[i * 4 + 3] = rgba;
+                }
+                if (m_format == Raw)
+                {
+                    m_file.write(reinterpret_cast<const char*>(m_convert.data()), CaptureFrameSize * 4);
+                }
+                else
+                {
+                    char name[32];
+                    std::snprintf(name, sizeof(name), "_%06llu.png", static_cast<unsigned long long>(m_written.load()));
+                    sf::Image image;
+                    image.create(CaptureWidth, CaptureHeight, m_convert.data());
+                    image.saveToFile(m_path + name);
+                }
+                break;
+            }
+            case Y4M:
+            {
+                // BT.601 studio range, planar Y, Cb, Cr
+                uint8_t* y = m_convert.data();
+                uint8_t* u = y + CaptureFrameSize;
+                uint8_t* v = u + CaptureFrameSize;
+                for (int i = 0; i < CaptureFrameSize; ++i)
+                {
+                    auto rgba = colormap[frame[i] & 0x3f];
+                    int r = (rgba >> 24) & 0xff, g = (rgba >> 16) & 0xff, b = (rgba >> 8) & 0xff;
+                    y[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+                    u[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+                    v[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+                }
+                m_file << "FRAME\n";
+                m_file.write(reinterpret_cast<const char*>(m_convert.data()), CaptureFrameSize * 3);
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,252 @@
+#include "codec.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace NESemu
+{
+    const int HashBits = 12;
+    const int MinMatch = 4;
+    const int MinRun = 3;
+    const std::size_t MaxDistance = 0xffff;
+    const int LengthMask = 0x3f;
+
+    static inline uint32_t read32(const uint8_t* p)
+    {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static inline uint32_t hash32(uint32_t v)
+    {
+        return (v * 2654435761u) >> (32 - HashBits);
+    }
+
+    static inline int bits_for(int colors)
+    {
+        int bits = 0;
+        while ((1 << bits) < colors)
+            ++bits;
+        return bits;
+    }
+
+    FrameCodec::FrameCodec() :
+        m_hash(1 << HashBits)
+    {
+        m_packed.reserve(256 * 240);
+    }
+
+    std::size_t FrameCodec::encode(const uint8_t* pixels, std::size_t count, std::vector<uint8_t>& out)
+    {
+        auto start = out.size();
+        if (!count)
+            return 0;
+
+        // palette remap
+        int16_t code[256];
+        uint8_t palette[256];
+        std::fill(code, code + 256, -1);
+        int colors = 0;
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            if (code[pixels[i]] < 0)
+            {
+                code[pixels[i]] = colors;
+                palette[colors++] = pixels[i];
+            }
+        }
+        out.push_back(colors - 1);
+        out.insert(out.end(), palette, palette + colors);
+
+        // bit-pack
+        int bits = bits_for(colors);
+        m_packed.resize((count * bits + 7) / 8);
+        uint8_t* dst = m_packed.data();
+        uint64_t acc = 0;
+        int filled = 0;
+        for (std::size_t i = 0; i < count && bits; ++i)
+        {
+            acc |= uint64_t(code[pixels[i]]) << filled;
+            filled += bits;
+            if (filled >= 32)
+            {
+                uint32_t word = uint32_t(acc);
+                dst[0] = word;
+                dst[1] = word >> 8;
+                dst[2] = word >> 16;
+                dst[3] = word >> 24;
+                dst += 4;
+                acc >>= 32;
+                filled -= 32;
+            }
+        }
+        for (; filled > 0; filled -= 8, acc >>= 8)
+            *dst++ = uint8_t(acc);
+
+        compress(m_packed.data(), m_packed.size(), out);
+        return out.size() - start;
+    }
+
+    bool FrameCodec::decode(const uint8_t* data, std::size_t size, uint8_t* pixels, std::size_t count)
+    {
+        if (!count)
+            return size == 0;
+        if (size < 1 || size < 2u + data[0])
+            return false;
+        int colors = data[0] + 1;
+        const uint8_t* palette = data + 1;
+        int bits = bits_for(colors);
+        if (!bits)
+        {
+            std::memset(pixels, palette[0], count);
+            return size == 2;
+        }
+
+        std::size_t packed_size = (count * bits + 7) / 8;
+        m_packed.resize(packed_size);
+        if (!decompress(data + 1 + colors, size - 1 - colors, m_packed.data(), packed_size))
+            return false;
+
+        const uint8_t* src = m_packed.data();
+        const uint8_t* end = src + packed_size;
+        uint64_t acc = 0;
+        int filled = 0;
+        uint32_t mask = (1u << bits) - 1;
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            while (filled < bits)
+            {
+                acc |= uint64_t(src < end ? *src++ : 0) << filled;
+                filled += 8;
+            }
+            auto c = acc & mask;
+            if (c >= uint32_t(colors))
+                return false;
+            pixels[i] = palette[c];
+            acc >>= bits;
+            filled -= bits;
+        }
+        return true;
+    }
+
+    static void put_length(std::vector<uint8_t>& out, std::size_t extra)
+    {
+        for (; extra >= 255; extra -= 255)
+            out.push_back(255);
+        out.push_back(extra);
+    }
+
+    static void put_literals(std::vector<uint8_t>& out, const uint8_t* src, std::size_t size)
+    {
+        while (size)
+        {
+            std::size_t n = size < 128 ? size : 128;
+            out.push_back(n - 1);
+            out.insert(out.end(), src, src + n);
+            src += n;
+            size -= n;
+        }
+    }
+
+    void FrameCodec::compress(const uint8_t* src, std::size_t size, std::vector<uint8_t>& out)
+    {
+        std::fill(m_hash.begin(), m_hash.end(), UINT32_MAX);
+        std::size_t pos = 0, literal = 0;
+        while (pos + MinMatch <= size)
+        {
+            // run
+            std::size_t run = 1;
+            while (pos + run < size && src[pos + run] == src[pos])
+                ++run;
+            if (run >= std::size_t(MinRun))
+            {
+                put_literals(out, src + literal, pos - literal);
+                auto len = run - MinRun;
+                out.push_back(0x80 | (len < LengthMask ? len : LengthMask));
+                if (len >= std::size_t(LengthMask))
+                    put_length(out, len - LengthMask);
+                out.push_back(src[pos]);
+                pos = literal = pos + run;
+                continue;
+            }
+
+            // match
+            auto h = hash32(read32(src + pos));
+            auto candidate = m_hash[h];
+            m_hash[h] = pos;
+            if (candidate != UINT32_MAX && pos - candidate <= MaxDistance && read32(src + candidate) == read32(src + pos))
+            {
+                std::size_t match = MinMatch;
+                while (pos + match < size && src[candidate + match] == src[pos + match])
+                    ++match;
+                put_literals(out, src + literal, pos - literal);
+                auto len = match - MinMatch;
+                auto distance = pos - candidate;
+                out.push_back(0xc0 | (len < LengthMask ? len : LengthMask));
+                if (len >= std::size_t(LengthMask))
+                    put_length(out, len - LengthMask);
+                out.push_back(distance & 0xff);
+                out.push_back(distance >> 8);
+                pos = literal = pos + match;
+                continue;
+            }
+            ++pos;
+        }
+        put_literals(out, src + literal, size - literal);
+    }
+
+    bool FrameCodec::decompress(const uint8_t* src, std::size_t size, uint8_t* dst, std::size_t dst_size)
+    {
+        const uint8_t* end = src + size;
+        std::size_t pos = 0;
+        while (src < end)
+        {
+            uint8_t c = *src++;
+            if (c < 0x80)
+            {
+                std::size_t n = c + 1;
+                if (std::size_t(end - src) < n || pos + n > dst_size)
+                    return false;
+                std::memcpy(dst + pos, src, n);
+                src += n;
+                pos += n;
+                continue;
+            }
+
+            std::size_t len = c & LengthMask;
+            if (len == std::size_t(LengthMask))
+            {
+                uint8_t b;
+                do
+                {
+                    if (src >= end)
+                        return false;
+                    b = *src++;
+                    len += b;
+                } while (b == 255);
+            }
+
+            if (c < 0xc0) // run
+            {
+                len += MinRun;
+                if (src >= end || pos + len > dst_size)
+                    return false;
+                std::memset(dst + pos, *src++, len);
+            }
+            else // match, may overlap
+            {
+                len += MinMatch;
+                if (end - src < 2)
+                    return false;
+                std::size_t distance = src[0] | (src[1] << 8);
+                src += 2;
+                if (!distance || distance > pos || pos + len > dst_size)
+                    return false;
+                for (std::size_t i = 0; i < len; ++i)
+                    dst[pos + i] = dst[pos + i - distance];
+            }
+            pos += len;
+        }
+        return pos == dst_size;
+    }
+}
@@ -0,0 +1,46 @@
+#include "console.hpp"
+
+namespace NESemu
+{
+    Console::Console() :
+        m_ppu(m_cartridge, m_cpu, m_screen),
+        m_cpu(m_cartridge, m_ppu, m_ports[0], m_ports[1])
+    {}
+
+    bool Console::load(const std::string& rom)
+    {
+        if (!m_cartridge.loadRom(rom))
+            return false;
+        m_cpu.reset();
+        m_ppu.reset();
+        return true;
+    }
+
+    void Console::emulate_frame()
+    {
+        auto flag = m_ppu.m_evenFrame;
+        while (flag == m_ppu.m_evenFrame)
+        {
+            m_ppu.step();
+            m_ppu.step();
+            m_ppu.step();
+            m_cpu.step();
+        }
+    }
+
+    void Console::saveState(Snapshot& s) const
+    {
+        m_cpu.save(s.cpu);
+        m_ppu.save(s.ppu);
+        m_ports[0].save(s.controller[0]);
+        m_ports[1].save(s.controller[1]);
+    }
+
+    void Console::loadState(const Snapshot& s)
+    {
+        m_cpu.load(s.cpu);
+        m_ppu.load(s.ppu);
+        m_ports[0].load(s.controller[0]);
+        m_ports[1].load(s.controller[1]);
+    }
+}
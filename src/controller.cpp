@@ -1,4 +1,5 @@
 #include "controller.hpp"
+#include "mailbox.hpp"
 #include <iostream>
 
 namespace NESemu
@@ -6,6 +7,7 @@ namespace NESemu
     PhyController::PhyController() :
         m_flag(false),
         m_keyStates(0),
+        m_latched(0),
         m_keyBindings(TotalButtons)
     {}
 
@@ -14,16 +16,22 @@ namespace NESemu
         // 0x01 -> 0x00 と書き込まれたらキー状態を取得
         if (m_flag && ((b & 1) == 0))
         {
-            m_keyStates = 0;
-            int shift = 0;
-            for (int button = A; button < TotalButtons; ++button)
-            {
-                m_keyStates |= (sf::Keyboard::isKeyPressed(m_keyBindings[button]) << shift++);
-            }
+            m_keyStates = m_latched = poll();
         }
         m_flag = (b & 1);
     }
 
+    unsigned int PhyController::poll() const
+    {
+        unsigned int keyStates = 0;
+        int shift = 0;
+        for (int button = A; button < TotalButtons; ++button)
+        {
+            keyStates |= (sf::Keyboard::isKeyPressed(m_keyBindings[button]) << shift++);
+        }
+        return keyStates;
+    }
+
     uint8_t PhyController::read()
     {
         // リードすると次のボタンの情報にシフト
@@ -33,9 +41,25 @@ namespace NESemu
     }
 
 
+    void PhyController::save(ControllerSnapshot& s) const
+    {
+        s.m_flag = m_flag;
+        s.m_keyStates = m_keyStates;
+        s.m_netKeyState = 0;
+    }
+
+    void PhyController::load(const ControllerSnapshot& s)
+    {
+        m_flag = s.m_flag;
+        m_keyStates = s.m_keyStates;
+    }
+
+
     NetController::NetController() :
         m_flag(false),
-        m_keyStates(0)
+        m_keyStates(0),
+        m_netKeyState(0),
+        m_mailbox(nullptr)
     {}
 
     void NetController::write(uint8_t b)
@@ -43,6 +67,9 @@ namespace NESemu
         // 0x01 -> 0x00 と書き込まれたらキー状態を取得
         if (m_flag && ((b & 1) == 0))
         {
+            uint8_t state;
+            if (m_mailbox && m_mailbox->consume(state))
+                m_netKeyState = state;
             m_keyStates = m_netKeyState;
         }
         m_flag = (b & 1);
@@ -55,4 +82,18 @@ namespace NESemu
         m_keyStates >>= 1;
         return ret | 0x40;
     }
+
+    void NetController::save(ControllerSnapshot& s) const
+    {
+        s.m_flag = m_flag;
+        s.m_keyStates = m_keyStates;
+        s.m_netKeyState = m_netKeyState;
+    }
+
+    void NetController::load(const ControllerSnapshot& s)
+    {
+        m_flag = s.m_flag;
+        m_keyStates = s.m_keyStates;
+        m_netKeyState = s.m_netKeyState;
+    }
 }
\ No newline at end of file
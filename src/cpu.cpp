@@ -1,4 +1,5 @@
 #include "cpu.hpp"
+#include <cstring>
 #include <iostream>
 #include <iomanip>
 
@@ -158,11 +159,55 @@ namespace NESemu
     CPU::CPU(Cartridge& c, PPU& p, Controller& c1, Controller& c2) :
         m_cartridge(c),
         m_ppu(p),
-        m_controller1(c1),
-        m_controller2(c2),
-        m_RAM(0x800, 0)
+        m_controller1(&c1),
+        m_controller2(&c2),
+        m_RAM(0x800, 0),
+        m_dirtyPages(0xff),
+        m_forkDirty(0xff)
     {}
 
+    void CPU::save(CPUSnapshot& s) const
+    {
+        saveRegisters(s);
+        std::memcpy(s.m_RAM, m_RAM.data(), sizeof(s.m_RAM));
+    }
+
+    void CPU::load(const CPUSnapshot& s)
+    {
+        loadRegisters(s);
+        std::memcpy(m_RAM.data(), s.m_RAM, sizeof(s.m_RAM));
+        m_dirtyPages = m_forkDirty = 0xff;
+    }
+
+    void CPU::saveRegisters(CPUSnapshot& s) const
+    {
+        s.r_PC = r_PC;
+        s.r_SP = r_SP;
+        s.r_A = r_A;
+        s.r_X = r_X;
+        s.r_Y = r_Y;
+        s.flags = f_N << 7 | f_V << 6 | f_D << 3 | f_I << 2 | f_Z << 1 | f_C;
+        s.m_skipCycles = m_skipCycles;
+        s.m_cycles = m_cycles;
+    }
+
+    void CPU::loadRegisters(const CPUSnapshot& s)
+    {
+        r_PC = s.r_PC;
+        r_SP = s.r_SP;
+        r_A = s.r_A;
+        r_X = s.r_X;
+        r_Y = s.r_Y;
+        f_N = s.flags & 0x80;
+        f_V = s.flags & 0x40;
+        f_D = s.flags & 0x8;
+        f_I = s.flags & 0x4;
+        f_Z = s.flags & 0x2;
+        f_C = s.flags & 0x1;
+        m_skipCycles = s.m_skipCycles;
+        m_cycles = s.m_cycles;
+    }
+
     void CPU::reset()
     {
         reset(readAddress(ResetVector));
@@ -793,9 +838,9 @@ namespace NESemu
                 switch(addr)
                 {
                     case(JOY1):
-                        return m_controller1.read();
+                        return m_controller1->read();
                     case(JOY2):
-                        return m_controller2.read();
+                        return m_controller2->read();
                     case(OAMDATA):
                         return m_ppu.getOAMData();
                 }
@@ -815,7 +860,11 @@ namespace NESemu
 
     void CPU::busWrite(uint16_t addr, uint8_t value){
         if (addr < 0x2000)
+        {
             m_RAM[addr & 0x7ff] = value;
+            m_dirtyPages |= 1 << ((addr & 0x7ff) >> 8);
+            m_forkDirty |= 1 << ((addr & 0x7ff) >> 8);
+        }
         else if (addr < 0x4020)
         {
             if (addr < 0x4000) //PPU registers, mirrored
@@ -850,8 +899,8 @@ namespace NESemu
                         DMA(value);
                         break;
                     case(JOY1):
-                        m_controller1.write(value);
-                        m_controller2.write(value);
+                        m_controller1->write(value);
+                        m_controller2->write(value);
                         break;
                     case(OAMDATA):
                         m_ppu.setOAMData(value);
@@ -864,9 +913,7 @@ namespace NESemu
         }
         else
         {
-            if(m_cartridge.m_PRG_ROM.size() == 0x4000)
-                m_cartridge.m_PRG_ROM[(addr - 0x8000) & 0x3fff] = value;
-            m_cartridge.m_PRG_ROM[(addr - 0x8000)] = value;
+            // mapper 0 has no registers and PRG-ROM is read only
         }
     }
 
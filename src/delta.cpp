@@ -0,0 +1,151 @@
+#include "delta.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace NESemu
+{
+    // number of differing pixels between frame and base shifted by (dx, dy), on every 8th scanline
+    static int motion_cost(const uint8_t* frame, const uint8_t* base, int dx, int dy)
+    {
+        int cost = 0;
+        int x0 = std::max(0, -dx), x1 = std::min(ScreenWidth, ScreenWidth - dx);
+        for (int y = BlockSize / 2; y < ScreenHeight; y += BlockSize)
+        {
+            int sy = y + dy;
+            if (sy < 0 || sy >= ScreenHeight)
+                continue;
+            const uint8_t* f = frame + y * ScreenWidth;
+            const uint8_t* b = base + sy * ScreenWidth + dx;
+            for (int x = x0; x < x1; ++x)
+                cost += f[x] != b[x];
+        }
+        return cost;
+    }
+
+    static bool block_equal(const uint8_t* frame, const uint8_t* base, int bx, int by, int dx, int dy)
+    {
+        int x = bx * BlockSize, y = by * BlockSize;
+        if (x + dx < 0 || x + dx + BlockSize > ScreenWidth || y + dy < 0 || y + dy + BlockSize > ScreenHeight)
+            return false;
+        for (int row = 0; row < BlockSize; ++row)
+        {
+            if (std::memcmp(frame + (y + row) * ScreenWidth + x,
+                            base + (y + dy + row) * ScreenWidth + x + dx, BlockSize) != 0)
+                return false;
+        }
+        return true;
+    }
+
+    std::size_t encode_delta(const uint8_t* frame, const uint8_t* base, std::vector<uint8_t>& out)
+    {
+        // global motion, zero wins ties
+        int best_dx = 0, best_dy = 0;
+        int best = motion_cost(frame, base, 0, 0);
+        for (int d = -MaxScroll; d <= MaxScroll && best; ++d)
+        {
+            if (!d)
+                continue;
+            int cost = motion_cost(frame, base, d, 0);
+            if (cost < best)
+            {
+                best = cost;
+                best_dx = d;
+                best_dy = 0;
+            }
+            cost = motion_cost(frame, base, 0, d);
+            if (cost < best)
+            {
+                best = cost;
+                best_dx = 0;
+                best_dy = d;
+            }
+        }
+
+        out.resize(DeltaHeaderSize);
+        out[0] = static_cast<uint8_t>(static_cast<int8_t>(best_dx));
+        out[1] = static_cast<uint8_t>(static_cast<int8_t>(best_dy));
+        std::memset(&out[2], 0, BlockCount / 4);
+
+        for (int by = 0; by < BlocksY; ++by)
+        {
+            for (int bx = 0; bx < BlocksX; ++bx)
+            {
+                int block = by * BlocksX + bx;
+                uint8_t code = BlockRaw;
+                if (block_equal(frame, base, bx, by, 0, 0))
+                    code = BlockSame;
+                else if ((best_dx || best_dy) && block_equal(frame, base, bx, by, best_dx, best_dy))
+                    code = BlockMoved;
+
+                out[2 + block / 4] |= code << ((block % 4) * 2);
+                if (code == BlockRaw)
+                {
+                    for (int row = 0; row < BlockSize; ++row)
+                    {
+                        const uint8_t* src = frame + (by * BlockSize + row) * ScreenWidth + bx * BlockSize;
+                        out.insert(out.end(), src, src + BlockSize);
+                    }
+                }
+            }
+        }
+        return out.size();
+    }
+
+    int delta_raw_blocks(const uint8_t* payload)
+    {
+        int raw = 0;
+        for (int block = 0; block < BlockCount; ++block)
+            raw += ((payload[2 + block / 4] >> ((block % 4) * 2)) & 3) == BlockRaw;
+        return raw;
+    }
+
+    // frame and base must not overlap
+    bool decode_delta(const uint8_t* payload, std::size_t size, const uint8_t* base, uint8_t* frame)
+    {
+        if (size < DeltaHeaderSize)
+            return false;
+        int dx = static_cast<int8_t>(payload[0]);
+        int dy = static_cast<int8_t>(payload[1]);
+        if (std::abs(dx) > MaxScroll || std::abs(dy) > MaxScroll)
+            return false;
+
+        const uint8_t* raw = payload + DeltaHeaderSize;
+        const uint8_t* end = payload + size;
+        for (int by = 0; by < BlocksY; ++by)
+        {
+            for (int bx = 0; bx < BlocksX; ++bx)
+            {
+                int block = by * BlocksX + bx;
+                int code = (payload[2 + block / 4] >> ((block % 4) * 2)) & 3;
+                int x = bx * BlockSize, y = by * BlockSize;
+                if (code == BlockMoved && (x + dx < 0 || x + dx + BlockSize > ScreenWidth ||
+                                           y + dy < 0 || y + dy + BlockSize > ScreenHeight))
+                    return false;
+                if (code == BlockRaw && end - raw < BlockSize * BlockSize)
+                    return false;
+
+                for (int row = 0; row < BlockSize; ++row)
+                {
+                    uint8_t* dst = frame + (y + row) * ScreenWidth + x;
+                    switch (code)
+                    {
+                        case BlockSame:
+                            std::memcpy(dst, base + (y + row) * ScreenWidth + x, BlockSize);
+                            break;
+                        case BlockMoved:
+                            std::memcpy(dst, base + (y + dy + row) * ScreenWidth + x + dx, BlockSize);
+                            break;
+                        case BlockRaw:
+                            std::memcpy(dst, raw, BlockSize);
+                            raw += BlockSize;
+                            break;
+                        default:
+                            return false;
+                    }
+                }
+            }
+        }
+        return raw == end;
+    }
+}
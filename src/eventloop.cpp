@@ -0,0 +1,123 @@
+#include "eventloop.hpp"
+#include <thread>
+#ifdef __linux__
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+namespace NESemu
+{
+    EventLoop::EventLoop() :
+        m_interval(0),
+        m_epoll(-1),
+        m_timer(-1),
+        m_socket(-1),
+        m_statSyscalls(0),
+        m_statWakeups(0),
+        m_statTicks(0),
+        m_statMissed(0)
+    {}
+
+    EventLoop::~EventLoop()
+    {
+        close();
+    }
+
+    bool EventLoop::open(std::chrono::microseconds interval, int socket)
+    {
+        close();
+        m_interval = interval;
+        m_next = std::chrono::steady_clock::now() + interval;
+#ifdef __linux__
+        m_epoll = ::epoll_create1(EPOLL_CLOEXEC);
+        m_timer = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (m_epoll < 0 || m_timer < 0)
+        {
+            close();
+            return false;
+        }
+        long us = interval.count();
+        itimerspec spec = {{us / 1000000, us % 1000000 * 1000}, {us / 1000000, us % 1000000 * 1000}};
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = m_timer;
+        // without a ticking timer wait() would block for good, the sleep path keeps time instead
+        if (::timerfd_settime(m_timer, 0, &spec, nullptr) != 0 || ::epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_timer, &event) != 0)
+        {
+            close();
+            return false;
+        }
+        if (socket >= 0)
+        {
+            // level triggered: whatever the handler leaves unread wakes us again
+            event.data.fd = socket;
+            if (::epoll_ctl(m_epoll, EPOLL_CTL_ADD, socket, &event) == 0)
+                m_socket = socket;
+        }
+        return true;
+#else
+        (void)socket;
+        return true;
+#endif
+    }
+
+    void EventLoop::close()
+    {
+#ifdef __linux__
+        if (m_timer >= 0)
+            ::close(m_timer);
+        if (m_epoll >= 0)
+            ::close(m_epoll);
+#endif
+        m_timer = m_epoll = m_socket = -1;
+    }
+
+    int EventLoop::wait()
+    {
+#ifdef __linux__
+        if (m_epoll >= 0)
+        {
+            epoll_event events[2];
+            int count;
+            do
+            {
+                count = ::epoll_wait(m_epoll, events, 2, -1);
+                ++m_statSyscalls;
+            } while (count < 0 && errno == EINTR);
+            ++m_statWakeups;
+
+            int happened = 0;
+            for (int i = 0; i < count; ++i)
+            {
+                if (events[i].data.fd == m_socket)
+                    happened |= Readable;
+                else if (events[i].data.fd == m_timer)
+                {
+                    uint64_t expirations = 0;
+                    ++m_statSyscalls;
+                    if (::read(m_timer, &expirations, sizeof(expirations)) == sizeof(expirations) && expirations)
+                    {
+                        happened |= Tick;
+                        ++m_statTicks;
+                        m_statMissed += expirations - 1;
+                    }
+                }
+            }
+            return happened;
+        }
+#endif
+        auto now = std::chrono::steady_clock::now();
+        if (now > m_next + m_interval)
+        {
+            m_statMissed += (now - m_next) / m_interval;
+            m_next = now;
+        }
+        std::this_thread::sleep_until(m_next);
+        m_next += m_interval;
+        ++m_statWakeups;
+        ++m_statTicks;
+        return Tick;
+    }
+}
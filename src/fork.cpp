@@ -0,0 +1,196 @@
+#include "fork.hpp"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <vector>
+#include "metrics.hpp"
+#include "savestate.hpp"
+
+namespace NESemu
+{
+    // where each page lives in the machine
+    static uint8_t* page(Console& console, int index)
+    {
+        if (index < 8)
+            return console.m_cpu.m_RAM.data() + index * ForkPageSize;
+        if (index < 16)
+            return console.m_ppu.m_RAM.data() + (index - 8) * ForkPageSize;
+        return console.m_ppu.m_spriteMemory.data();
+    }
+
+    // bit n: page n written since the last fork or load
+    static uint32_t fork_dirty(const Console& console)
+    {
+        return console.m_cpu.m_forkDirty | uint32_t(console.m_ppu.m_forkDirty & (PPU::DirtyOAM | 0xff)) << 8;
+    }
+
+    Forker::Forker(Console& console) :
+        m_console(console),
+        m_romHash(rom_hash(console.m_cartridge)),
+        m_base(),
+        m_statShared(0),
+        m_statCopied(0),
+        m_statLoaded(0)
+    {
+        m_base.m_romHash = m_romHash;
+    }
+
+    Fork Forker::fork()
+    {
+        CPU& cpu = m_console.m_cpu;
+        PPU& ppu = m_console.m_ppu;
+        uint32_t dirty = fork_dirty(m_console);
+        for (int i = 0; i < ForkPages; ++i)
+        {
+            if (m_base.m_pages[i] && !(dirty >> i & 1))
+            {
+                ++m_statShared;
+                continue;
+            }
+            auto copy = std::make_shared<std::array<uint8_t, ForkPageSize>>();
+            std::memcpy(copy->data(), page(m_console, i), ForkPageSize);
+            m_base.m_pages[i] = std::move(copy);
+            ++m_statCopied;
+        }
+        std::memcpy(m_base.m_palette, ppu.m_palette.data(), sizeof(m_base.m_palette));
+        cpu.saveRegisters(m_scratch.cpu);
+        ppu.saveRegisters(m_scratch.ppu);
+        std::memcpy(m_base.m_cpu, &m_scratch.cpu, CPURegistersSize);
+        std::memcpy(m_base.m_ppu, reinterpret_cast<const uint8_t*>(&m_scratch.ppu) + PPURegistersOffset, PPURegistersSize);
+        m_console.m_ports[0].save(m_base.m_controllers[0]);
+        m_console.m_ports[1].save(m_base.m_controllers[1]);
+        cpu.m_forkDirty = 0;
+        ppu.m_forkDirty = 0;
+        return m_base;
+    }
+
+    bool Forker::load(const Fork& fork)
+    {
+        if (fork.m_romHash != m_romHash)
+            return false;
+        CPU& cpu = m_console.m_cpu;
+        PPU& ppu = m_console.m_ppu;
+        uint32_t dirty = fork_dirty(m_console);
+        for (int i = 0; i < ForkPages; ++i)
+        {
+            // the same page, untouched since: the machine already holds it
+            if (fork.m_pages[i] && fork.m_pages[i] == m_base.m_pages[i] && !(dirty >> i & 1))
+                continue;
+            // only pointers that change pay for the reference count
+            if (fork.m_pages[i] != m_base.m_pages[i])
+                m_base.m_pages[i] = fork.m_pages[i];
+            if (fork.m_pages[i])
+                std::memcpy(page(m_console, i), fork.m_pages[i]->data(), ForkPageSize);
+            else
+                std::memset(page(m_console, i), 0, ForkPageSize);
+            // for StateHash; OAM is page 16, PPU bit 8
+            if (i < 8)
+                cpu.m_dirtyPages |= 1 << i;
+            else
+                ppu.m_dirty |= 1 << (i - 8);
+            ++m_statLoaded;
+        }
+        std::memcpy(ppu.m_palette.data(), fork.m_palette, sizeof(fork.m_palette));
+        ppu.m_dirty |= PPU::DirtyPalette;
+        std::memcpy(&m_scratch.cpu, fork.m_cpu, CPURegistersSize);
+        std::memcpy(reinterpret_cast<uint8_t*>(&m_scratch.ppu) + PPURegistersOffset, fork.m_ppu, PPURegistersSize);
+        cpu.loadRegisters(m_scratch.cpu);
+        ppu.loadRegisters(m_scratch.ppu);
+        m_console.m_ports[0].load(fork.m_controllers[0]);
+        m_console.m_ports[1].load(fork.m_controllers[1]);
+        cpu.m_forkDirty = 0;
+        ppu.m_forkDirty = 0;
+        std::memcpy(m_base.m_palette, fork.m_palette, sizeof(m_base.m_palette));
+        std::memcpy(m_base.m_cpu, fork.m_cpu, sizeof(m_base.m_cpu));
+        std::memcpy(m_base.m_ppu, fork.m_ppu, sizeof(m_base.m_ppu));
+        std::memcpy(m_base.m_controllers, fork.m_controllers, sizeof(m_base.m_controllers));
+        return true;
+    }
+
+    static int64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void fork_benchmark(const std::string& rom, int forks)
+    {
+        Console console;
+        if (!console.load(rom))
+            return;
+        for (int f = 0; f < 120; ++f)
+            console.emulate_frame();
+
+        // a search: every 4th branch from the root, the others go on from the newest one, one frame each
+        auto from = [](int i){ return i % 4 == 0 ? -1 : i - 1; };
+        auto input = [](int i){ return uint8_t((i * 2654435761u) >> 24); };
+
+        Forker forker(console);
+        Fork root = forker.fork();
+        std::vector<Fork> branches;
+        branches.reserve(forks);
+        Histogram forkTime(forks), loadTime(forks);
+        for (int i = 0; i < forks; ++i)
+        {
+            int64_t start = now_ns();
+            forker.load(from(i) < 0 ? root : branches[from(i)]);
+            loadTime.add(now_ns() - start);
+            console.m_ports[0].m_netKeyState = input(i);
+            console.emulate_frame();
+            start = now_ns();
+            Fork fork = forker.fork();
+            forkTime.add(now_ns() - start);
+            branches.push_back(std::move(fork));
+        }
+
+        // the same search with save states
+        forker.load(root);
+        Snapshot rootState;
+        console.saveState(rootState);
+        std::vector<Snapshot> states;
+        states.reserve(forks);
+        Histogram saveTime(forks), restoreTime(forks);
+        for (int i = 0; i < forks; ++i)
+        {
+            int64_t start = now_ns();
+            console.loadState(from(i) < 0 ? rootState : states[from(i)]);
+            restoreTime.add(now_ns() - start);
+            console.m_ports[0].m_netKeyState = input(i);
+            console.emulate_frame();
+            // a new save state is new memory, as a fork's pages are
+            start = now_ns();
+            states.emplace_back();
+            console.saveState(states.back());
+            saveTime.add(now_ns() - start);
+        }
+
+        // every branch must be the machine its save state is
+        int mismatches = 0;
+        std::vector<uint8_t> a(SaveStateSize), b(SaveStateSize);
+        Snapshot s;
+        for (int i = 0; i < forks; ++i)
+        {
+            forker.load(branches[i]);
+            console.saveState(s);
+            put_save_state(a.data(), s, 0);
+            put_save_state(b.data(), states[i], 0);
+            mismatches += a != b;
+        }
+
+        std::set<const void*> pages;
+        for (const Fork& fork : branches)
+            for (const ForkPage& p : fork.m_pages)
+                pages.insert(p.get());
+        std::size_t forkBytes = pages.size() * ForkPageSize + forks * sizeof(Fork);
+        std::size_t stateBytes = std::size_t(forks) * sizeof(Snapshot);
+        std::cout << "forkbench: " << forks << " branches, " << forkTime.summary("fork", 1, "ns") << ", "
+                  << loadTime.summary("load", 1, "ns") << ", " << double(forker.m_statCopied) / (forks + 1)
+                  << " pages copied per fork" << std::endl;
+        std::cout << "forkbench: save states: " << saveTime.summary("save", 1, "ns") << ", "
+                  << restoreTime.summary("load", 1, "ns") << std::endl;
+        std::cout << "forkbench: " << forkBytes / 1024 << " KB in forks (" << forkBytes / forks << " bytes each, "
+                  << pages.size() << " distinct pages), " << stateBytes / 1024 << " KB in save states ("
+                  << sizeof(Snapshot) << " bytes each), " << mismatches << " mismatches" << std::endl;
+    }
+}
@@ -0,0 +1,106 @@
+#include "harness.hpp"
+#include "netplug.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+
+namespace NESemu
+{
+    const auto HarnessFrame = std::chrono::microseconds(1'000'000 / 60);
+
+    // a scrolling background with a square bouncing over it, enough change for deltas to matter
+    static void draw_frame(uint8_t* matrix, int frame)
+    {
+        for (int y = 0; y < ScreenHeight; ++y)
+        {
+            for (int x = 0; x < ScreenWidth; ++x)
+                matrix[y * ScreenWidth + x] = ((x + frame) / 16 + y / 16) % 4 + 0x21;
+        }
+        int bounce = frame % (2 * (ScreenWidth - 32));
+        int left = bounce < ScreenWidth - 32 ? bounce : 2 * (ScreenWidth - 32) - bounce;
+        for (int y = 100; y < 132; ++y)
+            std::fill(matrix + y * ScreenWidth + left, matrix + y * ScreenWidth + left + 32, 0x16);
+    }
+
+    bool loopback_harness(unsigned short port, const HarnessOptions& options)
+    {
+        const Shaping& shaping = options.m_shaping;
+        Netplug host(true, "127.0.0.1", port);
+        Netplug client(false, "127.0.0.1", port + 1);
+        if (!host.m_transport.open(port, "127.0.0.1", port + 1) ||
+            !client.m_transport.open(port + 1, "127.0.0.1", port))
+            return false;
+        host.m_transport.shape(shaping);
+        client.m_transport.shape(shaping);
+        host.m_delta = options.m_delta;
+        host.m_pack = options.m_pack;
+        host.m_fecGroup = fec_group(options.m_fecGroup);
+        host.m_rate.m_enabled = options.m_adaptive;
+
+        Screen hostScreen, clientScreen;
+        hostScreen.create(ScreenWidth, ScreenHeight, 1, sf::Color::White);
+        clientScreen.create(ScreenWidth, ScreenHeight, 1, sf::Color::White);
+
+        client.start_receiver();
+        std::atomic<bool> running(true);
+        uint32_t shown = 0;
+        std::thread window([&]{
+            PhyController pad;
+            pad.m_keyBindings.assign(Controller::TotalButtons, sf::Keyboard::Unknown);
+            uint32_t last = 0;
+            auto tick = Clock::now();
+            while (running)
+            {
+                client.send_controller_state(pad);
+                client.receive_screen(clientScreen);
+                shown += client.m_displayed != last;
+                last = client.m_displayed;
+                tick += HarnessFrame;
+                std::this_thread::sleep_until(tick);
+            }
+        });
+
+        NetController remote;
+        auto start = Clock::now();
+        auto tick = start;
+        for (int frame = 0; frame < options.m_frames; ++frame)
+        {
+            host.receive_controller_state(remote);
+            draw_frame(hostScreen.m_screen_matrix, frame);
+            host.send_screen(hostScreen);
+            tick += HarnessFrame;
+            std::this_thread::sleep_until(tick);
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        // let the last frames through the simulated delay before p2 stops
+        auto drain = std::chrono::milliseconds(int(shaping.m_delayMs + shaping.m_jitterMs) + 2 * FrameTimeoutMs);
+        std::this_thread::sleep_for(drain);
+        running = false;
+        window.join();
+        client.stop_receiver();
+
+        const Transport& out = host.m_transport;
+        const Transport& in = client.m_transport;
+        char line[256];
+        std::snprintf(line, sizeof(line), "loopback: %d frames in %.1f s, delay %.1f ms, jitter %.1f ms, loss %.1f%%, "
+                      "duplicate %.1f%%, reorder %.1f%%, rate %.0f kbit/s", options.m_frames, seconds, shaping.m_delayMs,
+                      shaping.m_jitterMs, shaping.m_loss * 100, shaping.m_duplicate * 100, shaping.m_reorder * 100,
+                      shaping.m_rateKbps);
+        std::cout << line << std::endl;
+        std::snprintf(line, sizeof(line), "  p1 -> p2: %.0f datagrams/s, %.1f kbit/s, %.1f%% frames decoded, %.1f%% shown",
+                      out.m_statSent / seconds, out.m_statBytes * 8 / seconds / 1000,
+                      client.m_decoded * 100.0 / options.m_frames, shown * 100.0 / options.m_frames);
+        std::cout << line << std::endl;
+        std::cout << "  shaped at p2: " << in.m_statShapedLost << " lost, " << in.m_statDuplicated << " duplicated, "
+                  << in.m_statReordered << " reordered, " << in.m_statQueueDrops << " bottleneck drops; at p1: "
+                  << out.m_statShapedLost << " lost, " << out.m_statDuplicated << " duplicated, " << out.m_statReordered
+                  << " reordered" << std::endl;
+        std::cout << "  latency: " << client.m_delivery.summary("delivery") << ", "
+                  << client.m_inputLatency.summary("input to display") << ", " << client.m_rtt.summary("rtt")
+                  << std::endl;
+        return client.m_decoded > 0;
+    }
+}
@@ -0,0 +1,69 @@
+#include "mailbox.hpp"
+#include <iostream>
+
+namespace NESemu
+{
+    const int MailboxStatInterval = 300;
+
+    InputMailbox::InputMailbox() :
+        m_seq(0),
+        m_input(0),
+        m_state(0),
+        m_time(0),
+        m_consumed(0),
+        m_statStrobes(0),
+        m_statRepeated(0),
+        m_statSkipped(0),
+        m_statRetries(0)
+    {}
+
+    void InputMailbox::publish(uint32_t input, uint8_t state)
+    {
+        uint32_t seq = m_seq.load(std::memory_order_relaxed);
+        m_seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_input = input;
+        m_state = state;
+        m_time = timestamp_us();
+        m_seq.store(seq + 2, std::memory_order_release);
+    }
+
+    bool InputMailbox::consume(uint8_t& state)
+    {
+        for (int attempt = 0; attempt < MailboxReadTries; ++attempt)
+        {
+            uint32_t seq = m_seq.load(std::memory_order_acquire);
+            if (seq & 1)
+                continue;
+            uint32_t input = m_input;
+            uint8_t newState = m_state;
+            uint32_t time = m_time;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (m_seq.load(std::memory_order_relaxed) != seq)
+                continue;
+            if (!input)
+                return false;
+            // an input taken again is older by now, that is staleness too
+            m_age.add(int32_t(timestamp_us() - time));
+            if (input == m_consumed)
+                ++m_statRepeated;
+            else if (m_consumed && input > m_consumed)
+                m_statSkipped += input - m_consumed - 1;
+            m_consumed = input;
+            state = newState;
+            if (++m_statStrobes == MailboxStatInterval)
+                report();
+            return true;
+        }
+        ++m_statRetries;
+        return false;
+    }
+
+    void InputMailbox::report()
+    {
+        std::cout << "mailbox: " << m_age.summary("input age", 1, "us") << ", " << m_statRepeated
+                  << " strobes without a new input, " << m_statSkipped << " inputs skipped, " << m_statRetries
+                  << " torn reads retried" << std::endl;
+        m_statStrobes = m_statRepeated = m_statSkipped = m_statRetries = 0;
+    }
+}
@@ -1,4 +1,7 @@
 #include "nes.hpp"
+#include "harness.hpp"
+#include "server.hpp"
+#include "fork.hpp"
 #include <string>
 #include <sstream>
 #include <iostream>
@@ -8,18 +11,108 @@ int main(int argc, char** argv)
     NESemu::KeyBinding p1 {sf::Keyboard::J, sf::Keyboard::K, sf::Keyboard::RShift, sf::Keyboard::Return,
                            sf::Keyboard::W, sf::Keyboard::S, sf::Keyboard::A, sf::Keyboard::D};
     
-    if (argc != 5){
+    if (argc >= 2 && std::string(argv[1]) == "--netbench"){
+        NESemu::transport_benchmark(argc >= 3 ? std::stoi(argv[2]) : 47000);
+        return 0;
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--fecbench"){
+        NESemu::fec_benchmark(argc >= 3 ? std::stoi(argv[2]) : 47000);
+        return 0;
+    }
+    if (argc >= 3 && std::string(argv[1]) == "--forkbench"){
+        NESemu::fork_benchmark(argv[2], argc >= 4 ? std::stoi(argv[3]) : 2048);
+        return 0;
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "--loopback"){
+        // --loopback [port] [delay,jitter,loss%,dup%,reorder%] [frames] [--delta] [--pack] [--fec n] [--adaptive]
+        NESemu::HarnessOptions options = {};
+        options.m_frames = 600;
+        unsigned short port = 47000;
+        int positional = 0;
+        for (int i = 2; i < argc; ++i)
+        {
+            std::string opt = argv[i];
+            if (opt == "--delta")
+                options.m_delta = true;
+            else if (opt == "--pack")
+                options.m_pack = true;
+            else if (opt == "--fec" && i + 1 < argc)
+                options.m_fecGroup = std::stoi(argv[++i]);
+            else if (opt == "--adaptive")
+                options.m_adaptive = true;
+            else if (positional == 0)
+            {
+                port = std::stoi(opt);
+                ++positional;
+            }
+            else if (positional == 1)
+            {
+                if (!NESemu::parse_shaping(opt, options.m_shaping))
+                {
+                    std::cerr << "invalid shaping: " << opt << std::endl;
+                    return 1;
+                }
+                ++positional;
+            }
+            else if (positional == 2)
+            {
+                options.m_frames = std::stoi(opt);
+                ++positional;
+            }
+            else
+            {
+                std::cerr << "invalid option: " << opt << std::endl;
+                return 1;
+            }
+        }
+        return NESemu::loopback_harness(port, options) ? 0 : 1;
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "--server"){
+        // --server port threads rom [rom...] [--delta] [--pack] [--fec n] [--adaptive]
+        if (argc < 5){
+            std::cerr << "invalid args" << std::endl;
+            return 1;
+        }
+        NESemu::ServerOptions options = {};
+        std::vector<std::string> roms;
+        for (int i = 4; i < argc; ++i)
+        {
+            std::string opt = argv[i];
+            if (opt == "--delta")
+                options.m_delta = true;
+            else if (opt == "--pack")
+                options.m_pack = true;
+            else if (opt == "--fec" && i + 1 < argc)
+                options.m_fecGroup = std::stoi(argv[++i]);
+            else if (opt == "--adaptive")
+                options.m_adaptive = true;
+            else
+                roms.push_back(opt);
+        }
+        NESemu::Server server(std::stoi(argv[2]), std::stoi(argv[3]), roms, options);
+        return server.run() ? 0 : 1;
+    }
+
+    if (argc < 5){
         std::cerr << "invalid args" << std::endl;
         return 1;
     }
 
     bool server;
+    bool spectator = false;
 
     std::string arg = argv[2];
     if (arg == "p1")
         server=true;
     else if (arg == "p2")
         server=false;
+    else if (arg == "spectator")
+    {
+        server=false;
+        spectator=true;
+    }
     else
     {
         std::cerr << "invalid args" << std::endl;
@@ -32,6 +125,103 @@ int main(int argc, char** argv)
     std::cout << argv[2] << std::endl;
     NESemu::NES emulator(argv[1], server, addr, stoi(port));
     emulator.setKeys(p1);
+    if (spectator)
+        emulator.setSpectator();
+
+    // options
+    std::string capturePath;
+    NESemu::Capture::Format captureFormat = NESemu::Capture::Raw;
+    bool captureDrop = true;
+    for (int i = 5; i < argc; ++i)
+    {
+        std::string opt = argv[i];
+        if (opt == "--capture" && i + 2 < argc)
+        {
+            std::string format = argv[++i];
+            capturePath = argv[++i];
+            if (format == "raw")
+                captureFormat = NESemu::Capture::Raw;
+            else if (format == "y4m")
+                captureFormat = NESemu::Capture::Y4M;
+            else if (format == "png")
+                captureFormat = NESemu::Capture::PNG;
+            else
+            {
+                std::cerr << "invalid capture format: " << format << std::endl;
+                return 1;
+            }
+        }
+        else if (opt == "--capture-wait")
+            captureDrop = false;
+        else if (opt == "--delta")
+            emulator.setDelta(true);
+        else if (opt == "--pack")
+            emulator.setPack(true);
+        else if (opt == "--rollback" && i + 1 < argc)
+            emulator.setRollback(std::stoi(argv[++i]));
+        else if (opt == "--fec" && i + 1 < argc)
+            emulator.setFec(std::stoi(argv[++i]));
+        else if (opt == "--adaptive")
+            emulator.setAdaptive(true);
+        else if (opt == "--pipeline")
+            emulator.setPipeline(true);
+        else if (opt == "--rewind" && i + 1 < argc)
+        {
+            // megabytes[,interval]
+            std::string value = argv[++i];
+            auto comma = value.find(',');
+            int interval = comma == std::string::npos ? 1 : std::stoi(value.substr(comma + 1));
+            emulator.setRewind(std::stod(value.substr(0, comma)), interval);
+        }
+        else if (opt == "--runahead" && i + 1 < argc)
+            emulator.setRunAhead(std::stoi(argv[++i]));
+        else if (opt == "--state" && i + 1 < argc)
+            emulator.setStatePath(argv[++i]);
+        else if (opt == "--input-thread")
+            emulator.setInputThread(true);
+        else if (opt == "--semantic")
+            emulator.setSemantic(true);
+        else if (opt == "--shm" && i + 1 < argc)
+            emulator.setShm(argv[++i]);
+        else if (opt == "--session" && i + 1 < argc)
+        {
+            // id[,player[,rom]], player 1 or 2, rom an index into the server's list
+            int values[3] = {0, 1, 0};
+            std::istringstream in(argv[++i]);
+            std::string field;
+            for (int n = 0; n < 3 && std::getline(in, field, ','); ++n)
+                values[n] = std::stoi(field);
+            if (values[0] <= 0 || values[1] < 1 || values[1] > 2 || values[2] < 0 || values[2] > 255)
+            {
+                std::cerr << "invalid session: " << argv[i] << std::endl;
+                return 1;
+            }
+            emulator.setSession(values[0], values[1] - 1, values[2]);
+        }
+        else if (opt == "--netsim" && i + 1 < argc)
+        {
+            NESemu::Shaping shaping;
+            if (!NESemu::parse_shaping(argv[++i], shaping))
+            {
+                std::cerr << "invalid shaping: " << argv[i] << std::endl;
+                return 1;
+            }
+            emulator.setShaping(shaping);
+        }
+        else if (opt == "--spectators" && i + 1 < argc)
+        {
+            if (!emulator.setSpectators(std::stoi(argv[++i])))
+                return 1;
+        }
+        else
+        {
+            std::cerr << "invalid option: " << opt << std::endl;
+            return 1;
+        }
+    }
+    if (!capturePath.empty() && !emulator.setCapture(capturePath, captureFormat, captureDrop))
+        return 1;
+
     emulator.run();
     return 0;
 }
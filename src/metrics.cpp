@@ -0,0 +1,50 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+namespace NESemu
+{
+    Histogram::Histogram(std::size_t window) :
+        m_samples(window),
+        m_next(0),
+        m_count(0)
+    {
+        m_sorted.reserve(window);
+    }
+
+    void Histogram::add(double value)
+    {
+        m_samples[m_next] = value;
+        m_next = (m_next + 1) % m_samples.size();
+        ++m_count;
+    }
+
+    void Histogram::clear()
+    {
+        m_next = m_count = 0;
+    }
+
+    // nearest rank
+    double Histogram::percentile(double p) const
+    {
+        std::size_t n = count();
+        if (!n)
+            return 0;
+        m_sorted.assign(m_samples.begin(), m_samples.begin() + n);
+        std::size_t rank = std::min(n - 1, std::size_t(std::ceil(p / 100 * n)) - (p > 0));
+        std::nth_element(m_sorted.begin(), m_sorted.begin() + rank, m_sorted.end());
+        return m_sorted[rank];
+    }
+
+    std::string Histogram::summary(const char* name, double scale, const char* unit) const
+    {
+        char text[128];
+        if (!count())
+            std::snprintf(text, sizeof(text), "%s -", name);
+        else
+            std::snprintf(text, sizeof(text), "%s %.2f/%.2f/%.2f %s", name, percentile(50) / scale,
+                          percentile(95) / scale, percentile(99) / scale, unit);
+        return text;
+    }
+}
@@ -1,7 +1,8 @@
 #include "nes.hpp"
-#include <thread>
+#include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <thread>
 
 namespace NESemu
 {
@@ -10,10 +11,24 @@ namespace NESemu
         m_ppu(m_cartridge, m_cpu, m_screen),
         m_cpu(m_cartridge, m_ppu, m_controller1, m_controller2),
         m_screenScale(4.f),
-        m_netplug(server, ipaddr, port)
+        m_inputThreaded(false),
+        m_netplug(server, ipaddr, port),
+        m_rollback(*this),
+        m_pipelined(false),
+        m_statePath(rom_path + ".state"),
+        m_romHash(0),
+        m_stateBuffer(SaveStateSize),
+        m_rewind(*this),
+        m_runAheadFrames(0),
+        m_runAhead(*this),
+        m_statLoopFrames(0),
+        m_lastLoopSyscalls(0),
+        m_lastSocketSyscalls(0),
+        m_lastWakeups(0)
     {
         if (!m_cartridge.loadRom(m_romPath))
             exit(1);
+        m_romHash = rom_hash(m_cartridge);
         
         // sfml window
         m_window.create(sf::VideoMode(256 * m_screenScale, 240 * m_screenScale), "NESemu", sf::Style::Titlebar | sf::Style::Close);
@@ -22,8 +37,6 @@ namespace NESemu
 
         m_cpu.reset();
         m_ppu.reset();
-
-        m_netplug.plug();
     }
 
     void NES::setKeys(KeyBinding& p1)
@@ -31,10 +44,144 @@ namespace NESemu
         m_controller1.m_keyBindings = p1;
     }
 
+    bool NES::setCapture(std::string path, Capture::Format format, bool dropFrames)
+    {
+        return m_capture.open(path, format, dropFrames);
+    }
+
+    void NES::setDelta(bool delta)
+    {
+        m_netplug.m_delta = delta;
+    }
+
+    void NES::setPack(bool pack)
+    {
+        m_netplug.m_pack = pack;
+    }
+
+    void NES::setFec(int group)
+    {
+        m_netplug.m_fecGroup = fec_group(group);
+        if (m_netplug.m_fecGroup != group)
+            std::cout << "fec: group of " << group << " datagrams not possible, using " << m_netplug.m_fecGroup << std::endl;
+        if (m_netplug.m_fecGroup)
+            std::cout << "fec: one parity datagram per " << m_netplug.m_fecGroup << " screen datagrams" << std::endl;
+    }
+
+    void NES::setRollback(int inputDelay)
+    {
+        m_rollback.start(inputDelay);
+    }
+
+    void NES::setSpectator()
+    {
+        m_netplug.m_spectator = true;
+    }
+
+    bool NES::setSpectators(unsigned short port)
+    {
+        return m_spectators.open(port);
+    }
+
+    void NES::setAdaptive(bool adaptive)
+    {
+        m_netplug.m_rate.m_enabled = adaptive;
+    }
+
+    // p2 only, p1 has nothing to join
+    void NES::setSession(uint32_t id, int player, int rom)
+    {
+        if (m_netplug.m_server)
+            return;
+        m_netplug.m_session = id;
+        m_netplug.m_player = player;
+        m_netplug.m_rom = rom;
+    }
+
+    // p1 only: encode and send on a worker while the next frame is emulated
+    void NES::setPipeline(bool pipeline)
+    {
+        m_pipelined = pipeline;
+    }
+
+    // p1 and p2 on one host: frames and inputs through /dev/shm instead of UDP
+    void NES::setShm(const std::string& name)
+    {
+        m_shmName = name;
+    }
+
+    // p1 only: send the PPU's state and register writes, p2 renders them
+    void NES::setSemantic(bool semantic)
+    {
+        m_netplug.m_semantic = semantic;
+    }
+
+    // p1 only: p2's inputs are received on their own thread and taken by the controller when the game reads it
+    void NES::setInputThread(bool threaded)
+    {
+        m_inputThreaded = threaded;
+    }
+
+    void NES::setStatePath(const std::string& path)
+    {
+        m_statePath = path;
+    }
+
+    // p1 only: keep megabytes of history, hold backspace to go back
+    void NES::setRewind(double megabytes, int interval)
+    {
+        if (m_netplug.m_server)
+            m_rewind.start(std::size_t(megabytes * 1024 * 1024), interval);
+    }
+
+    // p1 only: show the frame this many frames ahead of the live one
+    void NES::setRunAhead(int frames)
+    {
+        m_runAheadFrames = frames;
+    }
+
+    void NES::setShaping(const Shaping& shaping)
+    {
+        m_netplug.m_transport.shape(shaping);
+    }
+
     void NES::run()
     {
+        if (!m_shmName.empty() && !m_rollback.m_enabled)
+        {
+            if (!m_shm.open(m_shmName, m_netplug.m_server))
+                return;
+        }
+        else
+            m_netplug.plug();
+        if (!m_netplug.m_server)
+            m_netplug.m_romPath = m_romPath;
+        if (m_inputThreaded && m_netplug.m_server && !m_rollback.m_enabled && !m_shm.isOpen())
+        {
+            m_controller2.m_mailbox = &m_mailbox;
+            m_netplug.start_input_thread(m_mailbox);
+        }
+
+        // p2 draws whatever frame the network thread finished last, the window never waits for the network
+        if (!m_netplug.m_server && !m_rollback.m_enabled && !m_shm.isOpen())
+            m_netplug.start_receiver();
+
+        // p1 and rollback keep time: a frame starts on each tick, datagrams are handled in between
+        bool timed = m_netplug.m_server || m_rollback.m_enabled;
+        if (timed)
+        {
+            // the socket belongs to whichever thread receives from it
+            bool socket = !m_shm.isOpen() && !m_netplug.m_mailbox;
+            if (!m_loop.open(std::chrono::microseconds(1'000'000 / 60), socket ? m_netplug.m_transport.m_fd : -1))
+                std::cerr << "loop: epoll timer unavailable, sleeping between frames" << std::endl;
+        }
+        if (m_pipelined && m_netplug.m_server && !m_rollback.m_enabled && !m_shm.isOpen() && !m_netplug.m_semantic)
+            m_pipeline.start(m_netplug, m_spectators);
+        // a rollback peer's machine is not ours to run ahead
+        if (m_runAheadFrames > 0 && m_netplug.m_server && !m_rollback.m_enabled)
+            m_runAhead.start(m_runAheadFrames, std::thread::hardware_concurrency() > 1);
+
         /* WINDOW LOOP */
-        m_cycleTimer = std::chrono::high_resolution_clock::now();
         sf::Event event;
         while (m_window.isOpen())
         {
@@ -44,40 +191,184 @@ namespace NESemu
                 if (event.type == sf::Event::Closed || (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::Escape))
                 {
                     m_window.close();
-                    return;
+                    break;
                 }
+                // p2 has no machine, and a rollback peer would fall out of step
+                bool local = m_netplug.m_server && !m_rollback.m_enabled;
+                if (local && event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::F5)
+                    saveStateFile();
+                else if (local && event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::F9)
+                    loadStateFile();
             }
+            if (!m_window.isOpen())
+                break;
 
-            update_controller();
-            update_screen();
+            if (m_rollback.m_enabled)
+            {
+                m_rollback.update();
+            }
+            else
+            {
+                update_controller();
+                update_screen();
+            }
+
+            if (m_capture.isOpen())
+                m_capture.push(m_screen.m_screen_matrix);
 
             // Interval
-            if(m_netplug.m_server){
-                m_elapsedTime = std::chrono::high_resolution_clock::now() - m_cycleTimer;
-                std::this_thread::sleep_for(std::chrono::nanoseconds(1'000'000'000 / 60) - std::chrono::nanoseconds(m_elapsedTime));
-                m_cycleTimer = std::chrono::high_resolution_clock::now();
-            }
+            if (timed)
+                wait_frame();
 
             // Draw
             m_window.draw(m_screen);
             m_window.display();
         }
+
+        // the only way out: threads that use the rest stop first
+        m_pipeline.stop();      // sends through m_netplug and m_spectators
+        m_runAhead.stop();
+        m_netplug.stop_input_thread();
+        m_netplug.stop_receiver();
+        m_capture.close();
+    }
+
+    void NES::wait_frame()
+    {
+        int events;
+        do
+        {
+            events = m_loop.wait();
+            if (events & EventLoop::Readable)
+            {
+                if (m_rollback.m_enabled)
+                    m_rollback.receive_inputs();
+                else
+                    m_netplug.receive_from_p2();
+            }
+        } while (!(events & EventLoop::Tick));
+
+        if (++m_statLoopFrames == LoopStatInterval)
+        {
+            uint64_t loop = m_loop.m_statSyscalls - m_lastLoopSyscalls;
+            uint64_t socket = m_netplug.m_transport.m_statSyscalls - m_lastSocketSyscalls;
+            uint64_t wakeups = m_loop.m_statWakeups - m_lastWakeups;
+            std::cout << "loop: " << double(loop + socket) / m_statLoopFrames << " syscalls/frame ("
+                      << double(loop) / m_statLoopFrames << " wait and timer, " << double(socket) / m_statLoopFrames
+                      << " socket), " << double(wakeups) / m_statLoopFrames << " wakeups/frame, "
+                      << m_loop.m_statMissed << " missed ticks" << std::endl;
+            m_lastLoopSyscalls = m_loop.m_statSyscalls;
+            m_lastSocketSyscalls = m_netplug.m_transport.m_statSyscalls;
+            m_lastWakeups = m_loop.m_statWakeups;
+            m_loop.m_statMissed = 0;
+            m_statLoopFrames = 0;
+        }
+    }
+
+    void NES::emulate_frame()
+    {
+        auto flag = m_ppu.m_evenFrame;
+        while(flag == m_ppu.m_evenFrame)
+        {
+            // PPUs
+            m_ppu.step();
+            m_ppu.step();
+            m_ppu.step();
+            // CPU
+            m_cpu.step();
+        }
+    }
+
+    void NES::saveState(Snapshot& s) const
+    {
+        m_cpu.save(s.cpu);
+        m_ppu.save(s.ppu);
+        m_cpu.m_controller1->save(s.controller[0]);
+        m_cpu.m_controller2->save(s.controller[1]);
+    }
+
+    void NES::loadState(const Snapshot& s)
+    {
+        m_cpu.load(s.cpu);
+        m_ppu.load(s.ppu);
+        m_cpu.m_controller1->load(s.controller[0]);
+        m_cpu.m_controller2->load(s.controller[1]);
+    }
+
+    void NES::saveStateFile()
+    {
+        uint32_t start = timestamp_us();
+        Snapshot s;
+        saveState(s);
+        put_save_state(m_stateBuffer.data(), s, m_romHash);
+        uint32_t saved = timestamp_us();
+        m_stateWriter.write(m_statePath, m_stateBuffer.data(), m_stateBuffer.size());
+        std::cout << "state: " << SaveStateSize << " bytes saved in " << saved - start << " us, queued for "
+                  << m_statePath << " in " << timestamp_us() - saved << " us" << std::endl;
+    }
+
+    void NES::loadStateFile()
+    {
+        // a save still being written is the one wanted
+        m_stateWriter.stop();
+        std::vector<uint8_t> data;
+        if (!read_state_file(m_statePath, data))
+        {
+            std::cerr << "state: open failed... " << m_statePath << std::endl;
+            return;
+        }
+        uint32_t start = timestamp_us();
+        Snapshot s;
+        std::string error;
+        if (!get_save_state(data.data(), data.size(), m_romHash, s, error))
+        {
+            std::cerr << "state: " << m_statePath << ": " << error << std::endl;
+            return;
+        }
+        loadState(s);
+        std::cout << "state: loaded in " << timestamp_us() - start << " us from " << m_statePath << std::endl;
     }
 
     void NES::update_screen(){
         if(m_netplug.m_server)
         {
-            auto flag = m_ppu.m_evenFrame;
-            while(flag == m_ppu.m_evenFrame)
+            // back RewindStep + 1 frames, then on by one: the frame shown is the one rewound to
+            if (m_rewind.m_enabled && sf::Keyboard::isKeyPressed(sf::Keyboard::BackSpace))
+                m_rewind.seek(m_rewind.m_frame - std::min<uint32_t>(m_rewind.m_frame, RewindStep + 1));
+            uint32_t start = timestamp_us();
+            bool semantic = m_netplug.m_semantic && !m_shm.isOpen();
+            if (semantic)
             {
-                // PPUs
-                m_ppu.step();
-                m_ppu.step();
-                m_ppu.step();
-                // CPU
-                m_cpu.step();
+                m_ppu.save(m_traceStart);
+                m_trace.begin();
+                m_ppu.m_trace = &m_trace;
             }
-            m_netplug.send_screen(m_screen);
+            emulate_frame();
+            m_ppu.m_trace = nullptr;
+            if (m_rewind.m_enabled)
+                m_rewind.record();
+            if (m_runAhead.m_enabled)
+                m_runAhead.begin();
+            if (semantic)
+            {
+                if (m_netplug.send_state(m_traceStart, m_trace, m_screen.m_screen_matrix, m_netplug.applied_input()) &&
+                    m_spectators.isOpen())
+                    m_spectators.send_frame(m_netplug, m_screen.m_screen_matrix);
+            }
+            else if (m_shm.isOpen())
+                m_shm.publish(m_screen.m_screen_matrix, m_shm.m_inputSeq);
+            else if (m_pipeline.isRunning())
+                m_pipeline.push(m_screen.m_screen_matrix, m_netplug.applied_input(), timestamp_us() - start);
+            else if (m_netplug.send_screen(m_screen) && m_spectators.isOpen())
+                m_spectators.send_frame(m_netplug, m_screen.m_screen_matrix);
+            if (m_runAhead.m_enabled)
+                m_runAhead.finish();
+        }
+        else if (m_shm.isOpen())
+        {
+            m_shm.view_frame(m_shm.m_displayed, [this](const uint8_t* pixels, uint32_t, uint32_t){
+                m_screen.setFrame(pixels);
+            });
         }
         else
         {
@@ -86,9 +377,27 @@ namespace NESemu
     }
 
     void NES::update_controller(){
-        if(m_netplug.m_server)
-            m_netplug.receive_controller_state(m_controller2);
-        else
+        if (m_shm.isOpen())
+        {
+            uint8_t state;
+            uint32_t input;
+            if (m_netplug.m_server && m_shm.read_input(state, input))
+                m_controller2.m_netKeyState = state;
+            else if (!m_netplug.m_server && !m_netplug.m_spectator)
+                m_shm.write_input(m_controller1.poll());
+        }
+        else if(m_netplug.m_server)
+        {
+            // with the input thread the controller takes the newest input itself
+            if (m_netplug.m_mailbox)
+                return;
+            // the loop has already drained the socket; shaped datagrams are only released by a receive
+            if (m_loop.m_epoll >= 0 && m_loop.m_socket >= 0 && !m_netplug.m_transport.m_shaping.active())
+                m_netplug.apply_input(m_controller2);
+            else
+                m_netplug.receive_controller_state(m_controller2);
+        }
+        else if (!m_netplug.m_spectator)
             m_netplug.send_controller_state(m_controller1);
     }
 }
\ No newline at end of file
@@ -1,119 +1,1070 @@
 #include <netplug.hpp>
+#include <ppustream.hpp>
+#include <algorithm>
+#include <bitset>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 
 namespace NESemu{
+    FrameExchange::FrameExchange() :
+        m_ids(),
+        m_inputs(),
+        m_back(0),
+        m_front(1),
+        m_spare(2)
+    {
+        for (auto& buffer : m_buffers)
+            buffer.resize(ScreenSize);
+    }
+
+    void FrameExchange::publish(uint32_t id, uint32_t input)
+    {
+        m_ids[m_back] = id;
+        m_inputs[m_back] = input;
+        m_back = m_spare.exchange(m_back | Fresh, std::memory_order_acq_rel) & ~Fresh;
+    }
+
+    const uint8_t* FrameExchange::acquire()
+    {
+        if (!(m_spare.load(std::memory_order_relaxed) & Fresh))
+            return nullptr;
+        m_front = m_spare.exchange(m_front, std::memory_order_acq_rel) & ~Fresh;
+        return m_buffers[m_front].data();
+    }
+
     Netplug::Netplug(bool server, std::string ipaddr, int port) :
         m_server(server),
         m_ipaddr(ipaddr),
-        m_port(port)
+        m_port(port),
+        m_delta(false),
+        m_frame(0),
+        m_ackFrame(0),
+        m_lastKeyframe(0),
+        m_sentType(ScreenKey),
+        m_sentTime(0),
+        m_sentInput(0),
+        m_sentBase(0),
+        m_sentPayload(nullptr),
+        m_sentSize(0),
+        m_pacing(false),
+        m_history(ScreenHistory * ScreenSize),
+        m_historyIds(ScreenHistory, UINT32_MAX),
+        m_historyInputs(ScreenHistory, 0),
+        m_slots(),
+        m_presented(0),
+        m_lastTransit(0),
+        m_haveTransit(false),
+        m_jitter(0),
+        m_depth(0),
+        m_decoded(0),
+        m_receiving(false),
+        m_spectator(false),
+        m_statBytes(0),
+        m_statFrames(0),
+        m_statKeyframes(0),
+        m_statTime(0),
+        m_statLate(0),
+        m_statDropped(0),
+        m_statTorn(0),
+        m_statRecovered(0),
+        m_fecGroup(0),
+        m_reportChunks(0),
+        m_reportLost(0),
+        m_reportFrames(0),
+        m_reportTransit(0),
+        m_minTransit{INT32_MAX, INT32_MAX},
+        m_displayed(0),
+        m_inputSeq(0),
+        m_inputHistory(),
+        m_inputs(),
+        m_inputNext(0),
+        m_inputNewest(0),
+        m_statInputFrames(0),
+        m_statInputs(0),
+        m_statInputsLate(0),
+        m_statInputsLost(0),
+        m_statInputStalls(0),
+        m_statInputAge(0),
+        m_mailbox(nullptr),
+        m_inputRunning(false),
+        m_clockOffset(0),
+        m_bestRtt(UINT32_MAX),
+        m_statLostChunks(0),
+        m_statReordered(0),
+        m_lastFrameSeen(0),
+        m_lastIndexSeen(0),
+        m_inputTimes(),
+        m_shownInput(0),
+        m_statShown(0),
+        m_pack(false),
+        m_semantic(false),
+        m_stateSize(PPUStateSize),
+        m_stateHistory(ScreenHistory * PPUStateSize),
+        m_stateIds(ScreenHistory, UINT32_MAX),
+        m_verbose(true),
+        m_session(0),
+        m_player(0),
+        m_rom(0)
+    {
+        m_payload.reserve(DeltaHeaderSize + ScreenSize);
+        m_packed.reserve(DeltaHeaderSize + ScreenSize);
+        m_ready.reserve(ScreenHistory);
+    }
+
+    Netplug::~Netplug()
     {
+        stop_input_thread();
+        stop_receiver();
     }
 
     void Netplug::plug(){
-        m_socket.bind(m_port);
+        if (m_session)
+        {
+            // any local port, everything we send carries the session header
+            m_transport.open(0, m_ipaddr, m_port);
+            uint8_t header[SessionHeaderSize];
+            header[0] = SessionData;
+            put32(header + 1, m_session);
+            header[5] = m_player;
+            m_transport.setPrefix(header, SessionHeaderSize);
+            std::cout << "session " << m_session << " player " << m_player + 1 << " on "
+                      << m_ipaddr << ":" << m_port << std::endl;
+            return;
+        }
+        if (m_spectator)
+        {
+            // any local port, the host learns it from our joins
+            m_transport.open(0, m_ipaddr, m_port);
+            std::cout << "spectating " << m_ipaddr << ":" << m_port << std::endl;
+            return;
+        }
+        m_transport.open(m_port, m_ipaddr, m_port);
         std::cout << "plugged port : " << m_port << std::endl;
     }
 
-    void Netplug::send_screen(Screen& screen)
+    static_assert(MaxChunks <= 64, "chunk bitmap is 64 bits");
+    const int StatInterval = 300;
+    const auto FrameInterval = std::chrono::microseconds(1'000'000 / 60);
+
+    static double microseconds(Clock::duration d)
+    {
+        return std::chrono::duration<double, std::micro>(d).count();
+    }
+
+    bool Netplug::send_screen(Screen& screen)
     {
-        // DATA
-        int sent = 0;
-        while(sent != 256*240)
+        return send_screen(screen.m_screen_matrix, applied_input());
+    }
+
+    bool Netplug::send_screen(const uint8_t* matrix, uint32_t input)
+    {
+        auto start = Clock::now();
+        uint32_t ack;
+        bool dense, key;
         {
-            sf::Packet packet;
-            packet << uint8_t(0); // DATA header
-            packet << sent;
-            for (int i=0; i<std::min(256*240 - sent,1472 - 5); i++)
+            std::lock_guard<std::mutex> lock(m_feedbackLock);
+            if (m_rate.checkSilence(std::chrono::steady_clock::now()))
+                print_rate(1, 0);
+            if (!m_rate.sendThis())
+                return false;
+            ++m_frame;
+            std::memcpy(history(m_frame), matrix, ScreenSize);
+            m_historyIds[m_frame % ScreenHistory] = m_frame;
+
+            // keyframe when p2 has not acknowledged anything we still hold, or periodically for recovery
+            ack = m_ackFrame;
+            dense = m_rate.dense();
+            key = !(m_delta || dense) || !inHistory(ack) ||
+                  m_frame - m_lastKeyframe >= uint32_t(KeyframeInterval * m_rate.keyframeScale());
+            m_pacing = m_rate.paced();
+        }
+        bool pack = m_pack || dense;
+        PacketType type = ScreenDelta;
+        if (!key)
+        {
+            encode_delta(matrix, history(ack), m_payload);
+            if (pack)
             {
-                packet << screen.m_screen_matrix[sent + i];
+                // header stays as is, the raw blocks are packed
+                m_packed.assign(m_payload.begin(), m_payload.begin() + DeltaHeaderSize);
+                m_codec.encode(m_payload.data() + DeltaHeaderSize, m_payload.size() - DeltaHeaderSize, m_packed);
+                if (m_packed.size() < m_payload.size())
+                {
+                    m_payload.swap(m_packed);
+                    type = ScreenDeltaPacked;
+                }
             }
-            m_socket.send(packet, m_ipaddr, m_port);
-            sent +=std::min(256*240 - sent,1472 - 5);
+            key = m_payload.size() >= ScreenSize;
         }
-        
-        // END
-        sf::Packet packet;
-        packet << uint8_t(1); // END header
-        m_socket.send(packet, m_ipaddr, m_port);
+        const uint8_t* payload = m_payload.data();
+        std::size_t size = m_payload.size();
+        if (key)
+        {
+            // raw keyframes are chunked straight out of the history copy
+            type = ScreenKey;
+            payload = history(m_frame);
+            size = ScreenSize;
+            if (pack)
+            {
+                m_payload.clear();
+                if (m_codec.encode(matrix, ScreenSize, m_payload) < ScreenSize)
+                {
+                    type = ScreenKeyPacked;
+                    payload = m_payload.data();
+                    size = m_payload.size();
+                }
+            }
+            m_lastKeyframe = m_frame;
+            ++m_statKeyframes;
+        }
+        send_encoded(type, key ? m_frame : ack, payload, size, input, start);
+        return true;
+    }
+
+    bool Netplug::send_state(const PPUSnapshot& start, const PPUTrace& trace, const uint8_t* matrix, uint32_t input)
+    {
+        // a frame that rewrites video memory while it is drawn is cheaper as pixels
+        if (trace.m_events.size() > ScreenSize / 2)
+            return send_screen(matrix, input);
+        auto begin = Clock::now();
+        uint32_t ack;
+        bool key;
+        {
+            std::lock_guard<std::mutex> lock(m_feedbackLock);
+            if (m_rate.checkSilence(std::chrono::steady_clock::now()))
+                print_rate(1, 0);
+            if (!m_rate.sendThis())
+                return false;
+            ++m_frame;
+            std::memcpy(history(m_frame), matrix, ScreenSize);
+            m_historyIds[m_frame % ScreenHistory] = m_frame;
+            put_ppu_state(stateHistory(m_frame), start);
+            m_stateIds[m_frame % ScreenHistory] = m_frame;
+
+            // the state delta needs a base p2 has the state of, the pixels don't matter
+            ack = m_ackFrame;
+            key = !inStateHistory(ack) ||
+                  m_frame - m_lastKeyframe >= uint32_t(KeyframeInterval * m_rate.keyframeScale());
+            m_pacing = m_rate.paced();
+        }
+        m_stateRaw.assign(StateHeaderSize, 0);
+        put32(m_stateRaw.data(), trace.m_events.size());
+        if (key)
+            m_stateRaw.insert(m_stateRaw.end(), stateHistory(m_frame), stateHistory(m_frame) + PPUStateSize);
+        else
+            encode_state_delta(stateHistory(ack), stateHistory(m_frame), m_stateRaw);
+        m_stateRaw.insert(m_stateRaw.end(), trace.m_events.begin(), trace.m_events.end());
+
+        m_payload.assign(StateHeaderSize, 0);
+        put32(m_payload.data(), m_stateRaw.size());
+        m_codec.compress(m_stateRaw.data(), m_stateRaw.size(), m_payload);
+        if (key)
+        {
+            m_lastKeyframe = m_frame;
+            ++m_statKeyframes;
+        }
+        send_encoded(key ? ScreenState : ScreenStateDelta, key ? m_frame : ack, m_payload.data(), m_payload.size(),
+                     input, begin);
+        return true;
+    }
+
+    // the frame is encoded: send it, then the periodic report
+    void Netplug::send_encoded(PacketType type, uint32_t base, const uint8_t* payload, std::size_t size, uint32_t input,
+                               Clock::time_point start)
+    {
+        auto encoded = Clock::now();
+        m_statTime += encoded - start;
+        m_encodeTime.add(microseconds(encoded - start));
+        m_sentType = type;
+        m_sentBase = base;
+        m_sentPayload = payload;
+        m_sentSize = size;
+        m_sentTime = timestamp_us();
+        m_sentInput = input;
+        send_frame(m_sentType, m_sentBase, payload, size);
+        auto sent = Clock::now();
+        m_sendTime.add(microseconds(sent - encoded));
+        if (sent - m_lastPing >= std::chrono::milliseconds(PingIntervalMs))
+            send_ping();
+
+        if (++m_statFrames == StatInterval)
+        {
+            if (m_verbose)
+            {
+                std::lock_guard<std::mutex> lock(m_feedbackLock);
+                std::cout << "screen: " << m_statBytes / m_statFrames << " bytes/frame, "
+                          << m_statKeyframes << " keyframes, encode "
+                          << std::chrono::duration_cast<std::chrono::microseconds>(m_statTime).count() / m_statFrames
+                          << " us/frame, rate level " << m_rate.m_level << std::endl;
+                std::cout << "latency: " << m_rtt.summary("rtt") << ", " << m_encodeTime.summary("encode")
+                          << ", " << m_sendTime.summary("send") << std::endl;
+            }
+            m_statBytes = m_statFrames = m_statKeyframes = 0;
+            m_statTime = {};
+        }
+    }
+
+    void Netplug::send_frame(PacketType type, uint32_t base, const uint8_t* payload, std::size_t size)
+    {
+        uint32_t total = size;
+        uint16_t chunks = std::max<uint32_t>(1, (total + ChunkSize - 1) / ChunkSize);
+        auto start = Clock::now();
+        int paced = 0;
+        for (uint16_t index = 0; index < chunks; ++index)
+        {
+            if (m_pacing && m_transport.m_outCount >= PaceBurst)
+            {
+                // this burst now, the next one a share of the span later
+                m_transport.flush();
+                std::this_thread::sleep_until(start + std::chrono::microseconds(PaceSpanUs * ++paced * PaceBurst / chunks));
+            }
+            uint32_t offset = index * ChunkSize;
+            uint32_t length = std::min<uint32_t>(total - offset, ChunkSize);
+            uint8_t* p = put_chunk_header(m_transport.datagram(), {type, m_frame, base, total, index, chunks,
+                                                                   m_sentTime, m_sentInput});
+            std::memcpy(p, payload + offset, length);
+            m_transport.push(ChunkHeaderSize + length);
+            m_statBytes += ChunkHeaderSize + length;
+
+            // after each group of m_fecGroup chunks, their XOR
+            if (m_fecGroup > 1 && ((index + 1) % m_fecGroup == 0 || index + 1 == chunks))
+            {
+                uint16_t group = index / m_fecGroup;
+                uint32_t first = group * m_fecGroup;
+                uint32_t parityLength = std::min<uint32_t>(total - first * ChunkSize, ChunkSize);
+                uint8_t* q = put_chunk_header(m_transport.datagram(), {ScreenParity, m_frame, base, total, group, chunks,
+                                                                       m_sentTime, m_sentInput});
+                *q++ = type;
+                *q++ = m_fecGroup;
+                std::memset(q, 0, parityLength);
+                for (uint32_t i = first; i <= index; ++i)
+                    xor_into(q, payload + i * ChunkSize, std::min<uint32_t>(total - i * ChunkSize, ChunkSize));
+                m_transport.push(ParityHeaderSize + parityLength);
+                m_statBytes += ParityHeaderSize + parityLength;
+            }
+        }
+        m_transport.flush();
+    }
+
+    static uint32_t chunk_length(uint32_t total, uint32_t index)
+    {
+        return std::min<uint32_t>(total - index * ChunkSize, ChunkSize);
+    }
+
+    void Netplug::receive_chunk(const uint8_t* data, std::size_t size)
+    {
+        if (size < ChunkHeaderSize)
+            return;
+        ChunkHeader header = get_chunk_header(data);
+        uint16_t index = header.m_index;
+        if (index >= header.m_chunks || size - ChunkHeaderSize != chunk_length(header.m_total, index))
+            return;
+        // p1 sends chunks in order, anything behind the newest seen was overtaken
+        if (header.m_frame < m_lastFrameSeen || (header.m_frame == m_lastFrameSeen && index < m_lastIndexSeen))
+            ++m_statReordered;
+        else
+        {
+            m_lastFrameSeen = header.m_frame;
+            m_lastIndexSeen = index;
+        }
+        FrameSlot* slot = find_slot(header);
+        if (!slot || (slot->m_received >> index) & 1)
+            return;
+
+        std::memcpy(slot->m_data.data() + index * ChunkSize, data + ChunkHeaderSize, size - ChunkHeaderSize);
+        slot->m_received |= uint64_t(1) << index;
+        ++m_reportChunks;
+        if (slot->m_group)
+            recover(*slot, index / slot->m_group);
+        complete(*slot);
+    }
+
+    // a ScreenParity datagram: chunk header with the group in place of the chunk index,
+    // then the frame's type and the group size
+    void Netplug::receive_parity(const uint8_t* data, std::size_t size)
+    {
+        if (size < ParityHeaderSize)
+            return;
+        ChunkHeader header = get_chunk_header(data);
+        header.m_type = data[ChunkHeaderSize];
+        uint16_t group = header.m_index;
+        uint16_t chunks = header.m_chunks;
+        uint8_t groupSize = data[ChunkHeaderSize + 1];
+        if (groupSize < 2 || groupSize > MaxFecGroup || group * groupSize >= chunks ||
+            size - ParityHeaderSize != chunk_length(header.m_total, group * groupSize))
+            return;
+        FrameSlot* slot = find_slot(header);
+        if (!slot || (slot->m_group && slot->m_group != groupSize) || (slot->m_parity >> group) & 1)
+            return;
+
+        slot->m_group = groupSize;
+        slot->m_parityData.resize((chunks + groupSize - 1) / groupSize * ChunkSize);
+        uint8_t* parity = slot->m_parityData.data() + group * ChunkSize;
+        std::memcpy(parity, data + ParityHeaderSize, size - ParityHeaderSize);
+        std::memset(parity + size - ParityHeaderSize, 0, ChunkSize - (size - ParityHeaderSize));
+        slot->m_parity |= uint64_t(1) << group;
+        recover(*slot, group);
+        complete(*slot);
+    }
+
+    FrameSlot* Netplug::find_slot(const ChunkHeader& header)
+    {
+        uint32_t frame = header.m_frame;
+        uint32_t total = header.m_total;
+        uint16_t chunks = header.m_chunks;
+        if (total > DeltaHeaderSize + ScreenSize || chunks == 0 || chunks > MaxChunks ||
+            chunks != std::max<uint32_t>(1, (total + ChunkSize - 1) / ChunkSize))
+            return nullptr;
+        if (m_frame && frame <= m_frame) // already decoded something newer
+        {
+            ++m_statLate;
+            return nullptr;
+        }
+
+        FrameSlot* slot = nullptr;
+        for (auto& s : m_slots)
+        {
+            if (s.m_used && s.m_frame == frame)
+                slot = &s;
+        }
+        if (!slot)
+        {
+            // a free slot, else give up the oldest frame in flight
+            for (auto& s : m_slots)
+            {
+                if (!slot || !s.m_used || (slot->m_used && s.m_frame < slot->m_frame))
+                    slot = &s;
+            }
+            if (slot->m_used)
+                lose_chunks(*slot);
+            slot->m_used = true;
+            slot->m_frame = frame;
+            slot->m_type = header.m_type;
+            slot->m_base = header.m_base;
+            slot->m_total = total;
+            slot->m_chunks = chunks;
+            slot->m_received = 0;
+            slot->m_group = 0;
+            slot->m_parity = 0;
+            slot->m_time = header.m_time;
+            slot->m_input = header.m_input;
+            slot->m_start = Clock::now();
+            slot->m_data.resize(total);
+        }
+        if (slot->m_type != header.m_type || slot->m_total != total)
+            return nullptr;
+        return slot;
+    }
+
+    // rebuilds the one missing chunk of a group from its parity
+    void Netplug::recover(FrameSlot& slot, int group)
+    {
+        if (!((slot.m_parity >> group) & 1))
+            return;
+        int first = group * slot.m_group;
+        int last = std::min<int>(first + slot.m_group, slot.m_chunks);
+        int missing = -1;
+        for (int i = first; i < last; ++i)
+        {
+            if ((slot.m_received >> i) & 1)
+                continue;
+            if (missing >= 0)
+                return; // more than one lost, XOR can not help
+            missing = i;
+        }
+        if (missing < 0)
+            return;
+
+        uint8_t* parity = slot.m_parityData.data() + group * ChunkSize;
+        for (int i = first; i < last; ++i)
+        {
+            if (i != missing)
+                xor_into(parity, slot.m_data.data() + i * ChunkSize, chunk_length(slot.m_total, i));
+        }
+        std::memcpy(slot.m_data.data() + missing * ChunkSize, parity, chunk_length(slot.m_total, missing));
+        slot.m_received |= uint64_t(1) << missing;
+        ++m_statRecovered;
+        ++m_statLostChunks;
+        ++m_reportLost;
+    }
+
+    // a frame given up on, its missing chunks count as lost
+    void Netplug::lose_chunks(const FrameSlot& slot)
+    {
+        ++m_statTorn;
+        uint32_t missing = slot.m_chunks - std::bitset<64>(slot.m_received).count();
+        m_statLostChunks += missing;
+        m_reportLost += missing;
+    }
+
+    void Netplug::complete(FrameSlot& slot)
+    {
+        if (slot.m_received != (slot.m_chunks == 64 ? ~uint64_t(0) : (uint64_t(1) << slot.m_chunks) - 1))
+            return;
+
+        slot.m_used = false;
+        if (!decode_frame(slot))
+            return;
+
+        auto now = Clock::now();
+        m_receiveTime.add(microseconds(now - slot.m_start));
+        if (m_bestRtt != UINT32_MAX)
+            m_delivery.add(int32_t(timestamp_us() + m_clockOffset - slot.m_time));
+
+        // jitter: change in transit time from one frame to the next, whatever the frame rate
+        int32_t transit = int32_t(timestamp_us() - slot.m_time);
+        if (m_haveTransit)
+        {
+            double d = int32_t(transit - m_lastTransit);
+            m_jitter += (std::abs(d) - m_jitter) / 16;
+            m_depth = std::min<int>(MaxJitterDepth, m_jitter * 2 / FrameInterval.count());
+        }
+        m_lastTransit = transit;
+        m_haveTransit = true;
+
+        // queueing: transit above the lowest recently seen, the clock offset cancels out
+        if (now - m_transitWindow > std::chrono::milliseconds(TransitWindowMs))
+        {
+            m_minTransit[0] = m_minTransit[1];
+            m_minTransit[1] = INT32_MAX;
+            m_transitWindow = now;
+        }
+        m_minTransit[1] = std::min(m_minTransit[1], transit);
+        m_reportTransit += transit - std::min(m_minTransit[0], m_minTransit[1]);
+        ++m_reportFrames;
+
+        // frames older than this one can not be decoded any more
+        for (auto& s : m_slots)
+        {
+            if (s.m_used && s.m_frame < slot.m_frame)
+            {
+                s.m_used = false;
+                lose_chunks(s);
+            }
+        }
+    }
+
+    bool Netplug::decode_frame(FrameSlot& slot)
+    {
+        auto start = Clock::now();
+        uint32_t frame = slot.m_frame;
+        uint32_t total = slot.m_total;
+        if (slot.m_type == ScreenState || slot.m_type == ScreenStateDelta)
+        {
+            if (!decode_state(slot))
+                return false;
+        }
+        else if (slot.m_type == ScreenKey || slot.m_type == ScreenKeyPacked)
+        {
+            if (slot.m_type == ScreenKey && total != ScreenSize)
+                return false;
+            if (slot.m_type == ScreenKey)
+                std::memcpy(history(frame), slot.m_data.data(), ScreenSize);
+            else if (!m_codec.decode(slot.m_data.data(), total, history(frame), ScreenSize))
+                return false;
+        }
+        else
+        {
+            const uint8_t* delta = slot.m_data.data();
+            std::size_t delta_size = total;
+            if (slot.m_type == ScreenDeltaPacked)
+            {
+                if (total < DeltaHeaderSize)
+                    return false;
+                std::size_t raw = delta_raw_blocks(delta) * BlockSize * BlockSize;
+                m_packed.assign(delta, delta + DeltaHeaderSize);
+                m_packed.resize(DeltaHeaderSize + raw);
+                if (!m_codec.decode(delta + DeltaHeaderSize, total - DeltaHeaderSize, m_packed.data() + DeltaHeaderSize, raw))
+                    return false;
+                delta = m_packed.data();
+                delta_size = m_packed.size();
+            }
+            // the base must be a frame we decoded, in a different slot
+            if (!inHistory(slot.m_base) || frame % ScreenHistory == slot.m_base % ScreenHistory ||
+                !decode_delta(delta, delta_size, history(slot.m_base), history(frame)))
+                return false;
+        }
+        auto decoded = Clock::now();
+        m_statTime += decoded - start;
+        m_decodeTime.add(microseconds(decoded - start));
+        m_statBytes += total;
+        m_historyIds[frame % ScreenHistory] = frame;
+        m_historyInputs[frame % ScreenHistory] = slot.m_input;
+        m_frame = frame;
+        ++m_decoded;
+        m_ready.push_back(frame);
+
+        // sent with the next flush, one per received batch
+        uint8_t* ack = m_transport.datagram();
+        ack[0] = ScreenAck;
+        put32(ack + 1, frame);
+        m_transport.push(5);
+        return true;
+    }
+
+    // [u32 raw size] compressed: [u32 events size][state or state delta][events]
+    bool Netplug::decode_state(FrameSlot& slot)
+    {
+        uint32_t frame = slot.m_frame;
+        const uint8_t* data = slot.m_data.data();
+        if (slot.m_total < StateHeaderSize)
+            return false;
+        std::size_t raw = get32(data);
+        if (raw < StateHeaderSize || raw > StateHeaderSize + 2 * m_stateSize + ScreenSize)
+            return false;
+        m_stateRaw.resize(raw);
+        if (!m_codec.decompress(data + StateHeaderSize, slot.m_total - StateHeaderSize, m_stateRaw.data(), raw))
+            return false;
+        std::size_t events = get32(m_stateRaw.data());
+        if (events > raw - StateHeaderSize)
+            return false;
+        const uint8_t* state = m_stateRaw.data() + StateHeaderSize;
+        std::size_t stateBytes = raw - StateHeaderSize - events;
+
+        // the slot is being overwritten, it is no base until the frame renders
+        m_stateIds[frame % ScreenHistory] = UINT32_MAX;
+        if (slot.m_type == ScreenState)
+        {
+            if (stateBytes != m_stateSize)
+                return false;
+            std::memcpy(stateHistory(frame), state, m_stateSize);
+        }
+        else if (!inStateHistory(slot.m_base) || frame % ScreenHistory == slot.m_base % ScreenHistory ||
+                 !decode_state_delta(state, stateBytes, stateHistory(slot.m_base), stateHistory(frame)))
+            return false;
+
+        if (!m_renderer)
+        {
+            if (m_romPath.empty())
+                return false;
+            m_renderer.reset(new StateRenderer);
+            if (!m_renderer->load(m_romPath))
+            {
+                std::cerr << "screen: semantic frames need the ROM, " << m_romPath << " did not load" << std::endl;
+                m_renderer.reset();
+                m_romPath.clear();
+                return false;
+            }
+        }
+        PPUSnapshot start;
+        get_ppu_state(stateHistory(frame), start);
+        if (!m_renderer->render(start, state + stateBytes, events, history(frame)))
+            return false;
+        m_stateIds[frame % ScreenHistory] = frame;
+        return true;
+    }
+
+    void Netplug::expire_frames(Clock::time_point now)
+    {
+        for (auto& s : m_slots)
+        {
+            if (s.m_used && now - s.m_start > std::chrono::milliseconds(FrameTimeoutMs))
+            {
+                s.m_used = false;
+                lose_chunks(s);
+            }
+        }
+    }
+
+    // publishes the newest decoded frame, keeping m_depth newer ones back unless forced
+    bool Netplug::present_frame(bool force)
+    {
+        // history slots may have been reused by newer frames
+        m_ready.erase(std::remove_if(m_ready.begin(), m_ready.end(),
+                                     [this](uint32_t f){ return !inHistory(f); }), m_ready.end());
+        if (m_ready.empty() || (!force && m_ready.size() <= std::size_t(m_depth)))
+            return false;
+
+        auto index = force ? m_ready.size() - 1 : m_ready.size() - 1 - m_depth;
+        uint32_t frame = m_ready[index];
+        m_ready.erase(m_ready.begin(), m_ready.begin() + index + 1);
+        if (m_presented)
+            m_statDropped += frame - m_presented - 1;
+        m_presented = frame;
+        std::memcpy(m_exchange.back(), history(frame), ScreenSize);
+        m_exchange.publish(frame, m_historyInputs[frame % ScreenHistory]);
+
+        if (++m_statFrames == StatInterval)
+        {
+            std::cout << "screen: " << m_statBytes / m_statFrames << " payload bytes/frame, decode "
+                      << std::chrono::duration_cast<std::chrono::microseconds>(m_statTime).count() / m_statFrames
+                      << " us/frame, late " << m_statLate << ", dropped " << m_statDropped
+                      << ", torn " << m_statTorn << ", recovered " << m_statRecovered << ", jitter "
+                      << int(m_jitter) << " us, depth " << m_depth << std::endl;
+            std::cout << "latency: " << m_rtt.summary("rtt") << ", " << m_delivery.summary("delivery") << ", "
+                      << m_receiveTime.summary("receive") << ", " << m_decodeTime.summary("decode") << ", lost "
+                      << m_statLostChunks << " chunks, reordered " << m_statReordered << std::endl;
+            m_statBytes = m_statFrames = m_statLate = m_statDropped = m_statTorn = m_statRecovered = 0;
+            m_statLostChunks = m_statReordered = 0;
+            m_statTime = {};
+        }
+        return true;
     }
 
     void Netplug::receive_screen(Screen& screen)
     {
-        sf::Packet packet;
-        sf::IpAddress remote_addr;
-        unsigned short remote_port;
-        for(;;)
-        {
-            uint8_t header;
-            m_socket.receive(packet, remote_addr, remote_port);
-            if ((remote_addr == static_cast<sf::IpAddress>(m_ipaddr)) && (remote_port == m_port)){
-                auto size = packet.getDataSize();
-                packet >> header;
-                if (header == 0){ // DATA
-                    int sent;
-                    packet >> sent;
-                    for (int i=0; i<size-1; i++)
-                    {
-                        packet >> screen.m_screen_matrix[sent + i];
-                    }
-                }
-                else // END
-                {
-                    break;
-                }
+        if (const uint8_t* frame = m_exchange.acquire())
+        {
+            screen.setFrame(frame);
+            m_displayed = m_exchange.m_ids[m_exchange.m_front];
+
+            // every input this frame is the first to reflect, from when we read it
+            uint32_t input = m_exchange.m_inputs[m_exchange.m_front];
+            if (input > m_shownInput && input <= m_inputSeq)
+            {
+                uint32_t now = timestamp_us();
+                for (uint32_t seq = std::max(m_shownInput + 1, input - std::min<uint32_t>(input, InputBuffer - 1));
+                     seq <= input; ++seq)
+                    m_inputLatency.add(now - m_inputTimes[seq % InputBuffer]);
+                m_shownInput = input;
+            }
+            if (++m_statShown == StatInterval)
+            {
+                std::cout << "latency: " << m_inputLatency.summary("input to display") << std::endl;
+                m_statShown = 0;
             }
         }
-        
-        for (int x=0; x<256; x++){
-            for (int y=0; y<240; y++){
-                screen.setPixel(x,y,screen.m_screen_matrix[x*240 + y]);
+    }
+
+    void Netplug::start_receiver()
+    {
+        if (m_receiving)
+            return;
+        m_receiving = true;
+        m_receiver = std::thread(&Netplug::receive_loop, this);
+    }
+
+    void Netplug::stop_receiver()
+    {
+        m_receiving = false;
+        if (m_receiver.joinable())
+            m_receiver.join();
+    }
+
+    void Netplug::receive_loop()
+    {
+        // short waits so stop_receiver is not held up by a silent peer
+        const auto WaitSlice = std::chrono::milliseconds(10);
+        const auto Timeout = std::chrono::milliseconds(FrameTimeoutMs);
+        auto deadline = Clock::now() + Timeout;
+        while (m_receiving)
+        {
+            auto now = Clock::now();
+            if ((m_spectator || m_session) && now - m_lastJoin >= std::chrono::milliseconds(SpectatorJoinMs))
+            {
+                // also keeps us registered
+                uint8_t join[2] = {m_session ? SessionJoin : SpectatorJoin, m_rom};
+                m_transport.send(join, m_session ? 2 : 1);
+                m_lastJoin = now;
             }
+            if (now - m_lastPing >= std::chrono::milliseconds(PingIntervalMs))
+                send_ping();
+            if (!m_spectator && now - m_lastReport >= std::chrono::milliseconds(ReportIntervalMs))
+                send_report(now);
+            if (present_frame(false))
+                deadline = now + Timeout;
+            expire_frames(now);
+            if (now >= deadline)
+            {
+                // nothing for a while, show what we have instead of waiting for more jitter depth
+                present_frame(true);
+                deadline = now + Timeout;
+            }
+
+            auto wait = std::min<Clock::duration>(deadline - now, WaitSlice);
+            if (m_transport.wait(std::chrono::duration_cast<std::chrono::microseconds>(wait).count()))
+                receive_datagrams();
         }
     }
 
-    void Netplug::send_controller_state(PhyController& controller)
+    // one batch of screen datagrams, acks go out together afterwards
+    void Netplug::receive_datagrams()
     {
-        unsigned int keyStates = 0;
-        int shift = 0;
-        for (int button = Controller::A; button < Controller::TotalButtons; ++button)
+        int count = m_transport.receive();
+        for (int i = 0; i < count; ++i)
         {
-            keyStates |= (sf::Keyboard::isKeyPressed(controller.m_keyBindings[button]) << shift++);
+            const Datagram& datagram = m_transport.m_in[i];
+            uint8_t header = datagram.m_data[0];
+            if (datagram.m_size && (header == ScreenKey || header == ScreenDelta || header == ScreenKeyPacked ||
+                                    header == ScreenDeltaPacked || header == ScreenState || header == ScreenStateDelta))
+                receive_chunk(datagram.m_data, datagram.m_size);
+            else if (datagram.m_size && header == ScreenParity)
+                receive_parity(datagram.m_data, datagram.m_size);
+            else if (datagram.m_size && (header == Ping || header == Pong))
+            {
+                uint8_t pong[PongSize];
+                if (receive_ping(datagram, pong))
+                    m_transport.send(pong, PongSize);
+            }
         }
+        m_transport.flush();
+    }
 
-        sf::Packet packet;
-        packet << keyStates;
-        m_socket.send(packet, m_ipaddr, m_port);
+    // p2: the newest input and the ones before it, numbered, with the frame on screen when it was read
+    void Netplug::send_controller_state(PhyController& controller)
+    {
+        ++m_inputSeq;
+        m_inputHistory[m_inputSeq % InputRedundancy] = controller.poll();
+        m_inputTimes[m_inputSeq % InputBuffer] = timestamp_us();
+        uint8_t count = std::min<uint32_t>(m_inputSeq, InputRedundancy);
+
+        uint8_t packet[InputHeaderSize + InputRedundancy];
+        packet[0] = ControllerState;
+        put32(packet + 1, m_inputSeq);
+        put32(packet + 5, m_displayed);
+        packet[9] = count;
+        for (int i = 0; i < count; ++i)
+            packet[InputHeaderSize + i] = m_inputHistory[(m_inputSeq - count + 1 + i) % InputRedundancy];
+        m_transport.send(packet, InputHeaderSize + count);
     }
         
     void Netplug::receive_controller_state(NetController& controller)
     {
-        sf::Packet packet;
-        sf::IpAddress remote_addr;
-        unsigned short remote_port;
+        receive_from_p2();
+        apply_input(controller);
+    }
 
-        m_socket.setBlocking(false);
-        for(;;) // dequeue all socket buffer
+    // everything queued; a batch that is not full means the socket is empty, no need to ask again
+    void Netplug::receive_from_p2()
+    {
+        int count;
+        do
         {
-            sf::Packet tmp_packet;
-            sf::IpAddress tmp_remote_addr;
-            unsigned short tmp_remote_port;
-            if (m_socket.receive(tmp_packet, tmp_remote_addr, tmp_remote_port) == sf::Socket::Status::Done)
+            count = m_transport.receive();
+            // pongs go out once the lock is released, the sender may be waiting for it
+            uint8_t pongs[DatagramBatch][PongSize];
+            int pongCount = 0;
+            std::unique_lock<std::mutex> lock(m_feedbackLock);
+            for (int i = 0; i < count; ++i)
             {
-                packet = tmp_packet;
-                remote_addr = tmp_remote_addr;
-                remote_port = tmp_remote_port;
-            } 
+                const Datagram& datagram = m_transport.m_in[i];
+                const uint8_t* data = datagram.m_data;
+                if (datagram.m_size == 1 + sizeof(uint32_t) && data[0] == ScreenAck)
+                {
+                    uint32_t value = get32(data + 1);
+                    if (value <= m_frame && value > m_ackFrame)
+                        m_ackFrame = value;
+                }
+                else if (datagram.m_size > InputHeaderSize && data[0] == ControllerState &&
+                         datagram.m_size == InputHeaderSize + data[9] && data[9] <= InputRedundancy)
+                {
+                    receive_inputs(get32(data + 1), get32(data + 5), data + InputHeaderSize, data[9]);
+                }
+                else if (datagram.m_size && (data[0] == Ping || data[0] == Pong))
+                    pongCount += receive_ping(datagram, pongs[pongCount]);
+                else if (datagram.m_size == ReportSize && data[0] == ScreenReport)
+                    receive_report(data);
+            }
+            lock.unlock();
+            for (int i = 0; i < pongCount; ++i)
+                m_transport.send(pongs[i], PongSize);
+        } while (count == DatagramBatch);
+    }
+
+    void Netplug::send_ping()
+    {
+        uint8_t packet[1 + sizeof(uint32_t)];
+        packet[0] = Ping;
+        put32(packet + 1, timestamp_us());
+        m_transport.send(packet, sizeof(packet));
+        m_lastPing = Clock::now();
+    }
+
+    // answers pings, times pongs: Ping [our time], Pong [their time][our time]
+    bool Netplug::receive_ping(const Datagram& datagram, uint8_t* pong)
+    {
+        const uint8_t* data = datagram.m_data;
+        if (data[0] == Ping && datagram.m_size == 5)
+        {
+            pong[0] = Pong;
+            std::memcpy(pong + 1, data + 1, sizeof(uint32_t));
+            put32(pong + 5, timestamp_us());
+            return true;
+        }
+        else if (data[0] == Pong && datagram.m_size == 9)
+        {
+            uint32_t sent = get32(data + 1);
+            uint32_t rtt = timestamp_us() - sent;
+            m_rtt.add(rtt);
+            // the quickest round trip was the most symmetric one, its midpoint lines the clocks up
+            if (rtt <= m_bestRtt)
+            {
+                m_bestRtt = rtt;
+                m_clockOffset = int32_t(get32(data + 5) - sent - rtt / 2);
+            }
+        }
+        return false;
+    }
+
+    // p2: how the screen stream fared since the last report
+    void Netplug::send_report(Clock::time_point now)
+    {
+        uint32_t expected = m_reportChunks + m_reportLost;
+        if (!expected)
+            return;
+        uint8_t packet[ReportSize];
+        packet[0] = ScreenReport;
+        put16(packet + 1, expected ? m_reportLost * 1000 / expected : 0);
+        put32(packet + 3, m_reportFrames ? uint32_t(m_reportTransit / m_reportFrames) : 0);
+        put16(packet + 7, std::min<uint32_t>(m_reportFrames, UINT16_MAX));
+        m_transport.send(packet, ReportSize);
+        m_reportChunks = m_reportLost = m_reportFrames = 0;
+        m_reportTransit = 0;
+        m_lastReport = now;
+    }
+
+    void Netplug::receive_report(const uint8_t* data)
+    {
+        double loss = get16(data + 1) / 1000.0;
+        uint32_t queueDelay = get32(data + 3);
+        if (m_rate.report(loss, queueDelay, std::chrono::steady_clock::now()))
+            print_rate(loss, queueDelay);
+    }
+
+    void Netplug::print_rate(double loss, uint32_t queueDelay)
+    {
+        if (!m_verbose)
+            return;
+        std::cout << "rate: level " << m_rate.m_level << " (loss " << loss * 100 << "%, queueing "
+                  << queueDelay / 1000 << " ms), " << 60 / m_rate.frameDivisor() << " fps"
+                  << (m_rate.paced() ? ", paced" : "") << (m_rate.dense() ? ", delta+pack" : "") << std::endl;
+    }
+
+    void Netplug::receive_inputs(uint32_t newest, uint32_t displayed, const uint8_t* inputs, int count)
+    {
+        if (newest < uint32_t(count))
+            return;
+        uint32_t oldest = newest - count + 1;
+        if (!m_inputNext)
+            m_inputNext = oldest; // first packet, p2 may have started before us
+        for (uint32_t seq = std::max(oldest, m_inputNext); seq <= newest; ++seq)
+        {
+            auto& input = m_inputs[seq % InputBuffer];
+            if (input.m_seq == seq)
+                continue;
+            input.m_seq = seq;
+            input.m_state = inputs[seq - oldest];
+            // p2 reads one input a frame, the older ones were read that many frames before the newest
+            input.m_displayed = displayed - std::min(displayed, newest - seq);
+        }
+        if (m_mailbox && newest > m_inputNewest)
+            m_mailbox->publish(newest, inputs[count - 1]);
+        m_inputNewest = std::max(m_inputNewest, newest);
+    }
+
+    // p1: one input per emulated frame, in p2's order
+    void Netplug::apply_input(NetController& controller)
+    {
+        auto have = [this](uint32_t seq){ return m_inputs[seq % InputBuffer].m_seq == seq; };
+        if (m_inputNext)
+        {
+            // more waiting than the queue allows: we fell behind p2, drop the oldest
+            while (m_inputNewest >= m_inputNext + InputQueueDepth)
+            {
+                if (have(m_inputNext))
+                    ++m_statInputsLate;
+                else
+                    ++m_statInputsLost;
+                ++m_inputNext;
+            }
+            // never arrived, although newer ones did, so it was outside every packet's history
+            while (m_inputNext <= m_inputNewest && !have(m_inputNext))
+            {
+                ++m_statInputsLost;
+                ++m_inputNext;
+            }
+            if (m_inputNext <= m_inputNewest)
+            {
+                auto& input = m_inputs[m_inputNext++ % InputBuffer];
+                controller.m_netKeyState = input.m_state;
+                std::lock_guard<std::mutex> lock(m_feedbackLock);
+                m_statInputAge += m_frame - std::min(m_frame, input.m_displayed);
+                ++m_statInputs;
+            }
             else
+                ++m_statInputStalls; // nothing for this frame, the last state is held
+        }
+
+        if (++m_statInputFrames == StatInterval)
+        {
+            if (m_verbose)
             {
-                break;
+                std::cout << "inputs: " << m_statInputs << " applied, " << m_statInputsLate << " late, "
+                          << m_statInputsLost << " lost, " << m_statInputStalls << " frames without input, age "
+                          << (m_statInputs ? double(m_statInputAge) / m_statInputs : 0) << " frames" << std::endl;
             }
+            m_statInputFrames = m_statInputs = m_statInputsLate = m_statInputsLost = m_statInputStalls = 0;
+            m_statInputAge = 0;
+        }
+    }
+
+    void Netplug::start_input_thread(InputMailbox& mailbox)
+    {
+        if (m_inputRunning)
+            return;
+        m_mailbox = &mailbox;
+        m_inputRunning = true;
+        m_inputThread = std::thread(&Netplug::input_loop, this);
+    }
+
+    void Netplug::stop_input_thread()
+    {
+        m_inputRunning = false;
+        if (m_inputThread.joinable())
+            m_inputThread.join();
+    }
+
+    void Netplug::input_loop()
+    {
+        // short waits so stop_input_thread is not held up by a silent peer
+        const int64_t WaitSliceUs = 10000;
+        while (m_inputRunning)
+        {
+            if (m_transport.wait(WaitSliceUs))
+                receive_from_p2();
         }
-        m_socket.setBlocking(true);
+    }
 
-        if((remote_addr == static_cast<sf::IpAddress>(m_ipaddr)) &&
-            (remote_port == m_port) &&
-            (packet.getDataSize() == sizeof(controller.m_netKeyState))
-        )
-            packet >> controller.m_netKeyState;
+    void fec_benchmark(unsigned short port, int frames)
+    {
+        // raw keyframes, the worst case: every frame is 48 chunks and stands alone
+        std::vector<uint8_t> matrix(ScreenSize);
+        for (double loss : {0.01, 0.05, 0.10})
+        {
+            for (int group : {0, 8, 4})
+            {
+                Netplug sender(true, "127.0.0.1", port);
+                Netplug receiver(false, "127.0.0.1", port + 1);
+                if (!sender.m_transport.open(port, "127.0.0.1", port + 1) ||
+                    !receiver.m_transport.open(port + 1, "127.0.0.1", port))
+                    return;
+                sender.m_fecGroup = group;
+                sender.m_transport.m_sendLoss = loss;
+
+                int complete = 0;
+                uint32_t recovered = 0;
+                for (int f = 1; f <= frames; ++f)
+                {
+                    for (int i = 0; i < ScreenSize; ++i)
+                        matrix[i] = (i + f) & 0x3f;
+                    sender.m_frame = f;
+                    sender.send_frame(ScreenKey, f, matrix.data(), ScreenSize);
+                    while (receiver.m_frame != uint32_t(f) && receiver.m_transport.wait(2000))
+                        receiver.receive_datagrams();
+                    complete += receiver.m_frame == uint32_t(f);
+                    recovered += receiver.m_statRecovered;
+                    receiver.m_statRecovered = 0;
+                    receiver.present_frame(true);
+                }
+                uint64_t sent = sender.m_transport.m_statSent + sender.m_transport.m_statLost;
+                std::cout << "loss " << int(loss * 100) << "%, "
+                          << (group ? "fec 1/" + std::to_string(group) : std::string("no fec")) << ": "
+                          << sent / frames << " datagrams/frame, " << sender.m_transport.m_statLost << " lost, "
+                          << recovered << " recovered (" << recovered * 100 / std::max<uint64_t>(1, sender.m_transport.m_statLost)
+                          << "%), " << complete * 100 / frames << "% frames complete" << std::endl;
+            }
+        }
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,122 @@
+#include "pipeline.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace NESemu
+{
+    const int PipelineStatInterval = 300;
+    const uint32_t PipelineSlots = PipelineDepth + 1;
+
+    SendPipeline::SendPipeline() :
+        m_head(0),
+        m_tail(0),
+        m_parked(false),
+        m_running(false),
+        m_netplug(nullptr),
+        m_spectators(nullptr),
+        m_statDropped(0),
+        m_statFrames(0),
+        m_statDepthSum(0),
+        m_statDepthMax(0)
+    {
+        for (auto& slot : m_slots)
+            slot.m_matrix.resize(ScreenSize);
+    }
+
+    SendPipeline::~SendPipeline()
+    {
+        stop();
+    }
+
+    void SendPipeline::start(Netplug& netplug, Spectators& spectators)
+    {
+        stop();
+        m_netplug = &netplug;
+        m_spectators = &spectators;
+        m_head = m_tail = 0;
+        m_running = true;
+        m_thread = std::thread(&SendPipeline::worker, this);
+        std::cout << "pipeline: encoding and sending on a worker, up to " << PipelineDepth << " frames queued" << std::endl;
+    }
+
+    // frames still queued are sent first
+    void SendPipeline::stop()
+    {
+        if (!m_thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(m_parkLock);
+            m_running = false;
+        }
+        m_wake.notify_one();
+        m_thread.join();
+    }
+
+    bool SendPipeline::push(const uint8_t* matrix, uint32_t input, uint32_t emulateUs)
+    {
+        uint32_t head = m_head.load(std::memory_order_relaxed);
+        uint32_t tail = m_tail.load(std::memory_order_acquire);
+        if ((head + 1) % PipelineSlots == tail)
+        {
+            ++m_statDropped;
+            return false;
+        }
+        Slot& slot = m_slots[head];
+        std::memcpy(slot.m_matrix.data(), matrix, ScreenSize);
+        slot.m_input = input;
+        slot.m_emulateUs = emulateUs;
+        slot.m_depth = (head + PipelineSlots - tail) % PipelineSlots;
+        slot.m_queued = timestamp_us();
+        // seq_cst with the worker's m_parked store: either it sees the frame or we see it parked
+        m_head.store((head + 1) % PipelineSlots);
+        if (m_parked.load())
+        {
+            std::lock_guard<std::mutex> lock(m_parkLock);
+            m_wake.notify_one();
+        }
+        return true;
+    }
+
+    void SendPipeline::worker()
+    {
+        for (;;)
+        {
+            uint32_t tail = m_tail.load(std::memory_order_relaxed);
+            if (tail == m_head.load(std::memory_order_acquire))
+            {
+                std::unique_lock<std::mutex> lock(m_parkLock);
+                m_parked = true;
+                m_wake.wait(lock, [this, tail]{ return m_head.load() != tail || !m_running; });
+                m_parked = false;
+                if (m_head.load() == tail)
+                    return;
+                continue;
+            }
+
+            Slot& slot = m_slots[tail];
+            uint32_t start = timestamp_us();
+            m_queueTime.add(int32_t(start - slot.m_queued));
+            m_emulateTime.add(slot.m_emulateUs);
+            m_statDepthSum += slot.m_depth;
+            m_statDepthMax = std::max(m_statDepthMax, slot.m_depth);
+
+            if (m_netplug->send_screen(slot.m_matrix.data(), slot.m_input) && m_spectators->isOpen())
+                m_spectators->send_frame(*m_netplug, slot.m_matrix.data());
+            m_stageTime.add(int32_t(timestamp_us() - start));
+            m_tail.store((tail + 1) % PipelineSlots, std::memory_order_release);
+
+            if (++m_statFrames == PipelineStatInterval)
+                report();
+        }
+    }
+
+    void SendPipeline::report()
+    {
+        if (m_netplug->m_verbose)
+            std::cout << "pipeline: depth " << double(m_statDepthSum) / m_statFrames << " avg, " << m_statDepthMax
+                      << " max, " << m_statDropped.exchange(0) << " dropped, " << m_emulateTime.summary("emulate")
+                      << ", " << m_queueTime.summary("queued") << ", " << m_stageTime.summary("encode+send") << std::endl;
+        m_statFrames = m_statDepthSum = m_statDepthMax = 0;
+    }
+}
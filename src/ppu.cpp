@@ -1,4 +1,7 @@
 #include "ppu.hpp"
+#include "ppustream.hpp"
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 
 namespace NESemu
@@ -19,12 +22,24 @@ namespace NESemu
         m_cartridge(cartridge),
         m_cpu(cpu),
         m_spriteMemory(64 * 4),
-        m_pictureBuffer(ScanlineVisibleDots, std::vector<uint8_t>(VisibleScanlines, 0b00100010))
+        m_pictureBuffer(ScanlineVisibleDots * VisibleScanlines, 0b00100010),
+        m_trace(nullptr),
+        m_dirty(DirtyAll),
+        m_forkDirty(DirtyAll)
     {}
 
+    // semantic streaming: only accesses up to the end of the picture shape it; after the
+    // picture the frame loop may run a few dots into the next pre-render line
+    static inline bool tracing(const PPU& ppu)
+    {
+        return ppu.m_trace && !ppu.m_trace->m_pictureDone && ppu.m_pipelineState <= PPU::Render;
+    }
+
     void PPU::reset()
     {
         m_longSprites = m_generateInterrupt = m_greyscaleMode = m_vblank = false;
+        m_sprZeroHit = m_hideEdgeSprites = m_hideEdgeBackground = false;
+        m_dataBuffer = 0;
         m_showBackground = m_showSprites = m_evenFrame = m_firstWrite = true;
         m_bgPage = m_sprPage = Low;
         m_dataAddress = m_cycle = m_scanline = m_spriteDataAddress = m_fineXScroll = m_tempAddress = 0;
@@ -36,8 +51,77 @@ namespace NESemu
         updateMirroring();
     }
 
+    void PPU::save(PPUSnapshot& s) const
+    {
+        std::memcpy(s.m_RAM, m_RAM.data(), sizeof(s.m_RAM));
+        std::memcpy(s.m_palette, m_palette.data(), sizeof(s.m_palette));
+        std::memcpy(s.m_spriteMemory, m_spriteMemory.data(), sizeof(s.m_spriteMemory));
+        saveRegisters(s);
+    }
+
+    void PPU::saveRegisters(PPUSnapshot& s) const
+    {
+        s.m_scanlineSpriteCount = m_scanlineSprites.size();
+        std::memcpy(s.m_scanlineSprites, m_scanlineSprites.data(), m_scanlineSprites.size());
+
+        s.m_pipelineState = m_pipelineState;
+        s.m_cycle = m_cycle;
+        s.m_scanline = m_scanline;
+        s.m_dataAddress = m_dataAddress;
+        s.m_tempAddress = m_tempAddress;
+        s.m_dataAddrIncrement = m_dataAddrIncrement;
+        s.m_fineXScroll = m_fineXScroll;
+        s.m_dataBuffer = m_dataBuffer;
+        s.m_spriteDataAddress = m_spriteDataAddress;
+        s.m_bgPage = m_bgPage;
+        s.m_sprPage = m_sprPage;
+        s.flags = m_evenFrame | m_vblank << 1 | m_sprZeroHit << 2 | m_firstWrite << 3 |
+                  m_longSprites << 4 | m_generateInterrupt << 5 | m_greyscaleMode << 6 |
+                  m_showSprites << 7 | m_showBackground << 8 | m_hideEdgeSprites << 9 |
+                  m_hideEdgeBackground << 10;
+    }
+
+    void PPU::load(const PPUSnapshot& s)
+    {
+        std::memcpy(m_RAM.data(), s.m_RAM, sizeof(s.m_RAM));
+        std::memcpy(m_palette.data(), s.m_palette, sizeof(s.m_palette));
+        std::memcpy(m_spriteMemory.data(), s.m_spriteMemory, sizeof(s.m_spriteMemory));
+        m_dirty = m_forkDirty = DirtyAll;
+        loadRegisters(s);
+    }
+
+    void PPU::loadRegisters(const PPUSnapshot& s)
+    {
+        m_scanlineSprites.assign(s.m_scanlineSprites, s.m_scanlineSprites + std::min<int>(s.m_scanlineSpriteCount, 8));
+
+        m_pipelineState = static_cast<State>(s.m_pipelineState);
+        m_cycle = s.m_cycle;
+        m_scanline = s.m_scanline;
+        m_dataAddress = s.m_dataAddress;
+        m_tempAddress = s.m_tempAddress;
+        m_dataAddrIncrement = s.m_dataAddrIncrement;
+        m_fineXScroll = s.m_fineXScroll;
+        m_dataBuffer = s.m_dataBuffer;
+        m_spriteDataAddress = s.m_spriteDataAddress;
+        m_bgPage = static_cast<CharacterPage>(s.m_bgPage);
+        m_sprPage = static_cast<CharacterPage>(s.m_sprPage);
+        m_evenFrame = s.flags & 1;
+        m_vblank = s.flags & (1 << 1);
+        m_sprZeroHit = s.flags & (1 << 2);
+        m_firstWrite = s.flags & (1 << 3);
+        m_longSprites = s.flags & (1 << 4);
+        m_generateInterrupt = s.flags & (1 << 5);
+        m_greyscaleMode = s.flags & (1 << 6);
+        m_showSprites = s.flags & (1 << 7);
+        m_showBackground = s.flags & (1 << 8);
+        m_hideEdgeSprites = s.flags & (1 << 9);
+        m_hideEdgeBackground = s.flags & (1 << 10);
+    }
+
     void PPU::step()
     {
+        if (m_trace)
+            ++m_trace->m_dot;
         switch (m_pipelineState)
         {
             case PreRender:
@@ -184,7 +268,7 @@ namespace NESemu
                     else if (!bgOpaque && !sprOpaque)
                         paletteAddr = 0;
 
-                    m_pictureBuffer[x][y] = readPalette(paletteAddr);
+                    m_pictureBuffer[y * ScanlineVisibleDots + x] = readPalette(paletteAddr);
                 }
                 else if (m_cycle == ScanlineVisibleDots + 1 && m_showBackground)
                 {
@@ -250,7 +334,11 @@ namespace NESemu
                 }
 
                 if (m_scanline >= VisibleScanlines)
+                {
                     m_pipelineState = PostRender;
+                    if (m_trace)
+                        m_trace->m_pictureDone = true;
+                }
 
                 break;
             case PostRender:
@@ -260,13 +348,7 @@ namespace NESemu
                     m_cycle = 0;
                     m_pipelineState = VerticalBlank;
 
-                    for (int x = 0; x < m_pictureBuffer.size(); ++x)
-                    {
-                        for (int y = 0; y < m_pictureBuffer[0].size(); ++y)
-                        {
-                            m_screen.setPixel(x, y, m_pictureBuffer[x][y]);
-                        }
-                    }
+                    m_screen.setFrame(m_pictureBuffer.data());
                 }
 
                 break;
@@ -306,10 +388,16 @@ namespace NESemu
     void PPU::writeOAM(uint8_t addr, uint8_t value)
     {
         m_spriteMemory[addr] = value;
+        m_dirty |= DirtyOAM;
+        m_forkDirty |= DirtyOAM;
     }
 
     void PPU::doDMA(const uint8_t* page_ptr)
     {
+        if (tracing(*this))
+            m_trace->record_dma(page_ptr);
+        m_dirty |= DirtyOAM;
+        m_forkDirty |= DirtyOAM;
         std::memcpy(m_spriteMemory.data() + m_spriteDataAddress, page_ptr, 256 - m_spriteDataAddress);
         if (m_spriteDataAddress)
             std::memcpy(m_spriteMemory.data(), page_ptr + (256 - m_spriteDataAddress), m_spriteDataAddress);
@@ -318,6 +406,8 @@ namespace NESemu
 
     void PPU::control(uint8_t ctrl)
     {
+        if (tracing(*this))
+            m_trace->record(PPUTrace::Control, ctrl);
         m_generateInterrupt = ctrl & 0x80;
         m_longSprites = ctrl & 0x20;
         m_bgPage = static_cast<CharacterPage>(!!(ctrl & 0x10));
@@ -335,6 +425,8 @@ namespace NESemu
 
     void PPU::setMask(uint8_t mask)
     {
+        if (tracing(*this))
+            m_trace->record(PPUTrace::Mask, mask);
         m_greyscaleMode = mask & 0x1;
         m_hideEdgeBackground = !(mask & 0x2);
         m_hideEdgeSprites = !(mask & 0x4);
@@ -346,6 +438,8 @@ namespace NESemu
     {
         uint8_t status = m_sprZeroHit << 6 |
                       m_vblank << 7;
+        if (tracing(*this) && (m_vblank || !m_firstWrite))
+            m_trace->record(PPUTrace::StatusRead);
         //m_dataAddress = 0;
         m_vblank = false;
         m_firstWrite = true;
@@ -354,6 +448,8 @@ namespace NESemu
 
     void PPU::setDataAddress(uint8_t addr)
     {
+        if (tracing(*this))
+            m_trace->record(PPUTrace::DataAddress, addr);
         //m_dataAddress = ((m_dataAddress << 8) & 0xff00) | addr;
         if (m_firstWrite)
         {
@@ -372,6 +468,8 @@ namespace NESemu
 
     uint8_t PPU::getData()
     {
+        if (tracing(*this))
+            m_trace->record(PPUTrace::DataRead);
         auto data = read(m_dataAddress);
         m_dataAddress += m_dataAddrIncrement;
 
@@ -392,22 +490,30 @@ namespace NESemu
 
     void PPU::setData(uint8_t data)
     {
+        if (tracing(*this))
+            m_trace->record(PPUTrace::Data, data);
         write(m_dataAddress, data);
         m_dataAddress += m_dataAddrIncrement;
     }
 
     void PPU::setOAMAddress(uint8_t addr)
     {
+        if (tracing(*this))
+            m_trace->record(PPUTrace::OAMAddress, addr);
         m_spriteDataAddress = addr;
     }
 
     void PPU::setOAMData(uint8_t value)
     {
+        if (tracing(*this))
+            m_trace->record(PPUTrace::OAMData, value);
         writeOAM(m_spriteDataAddress++, value);
     }
 
     void PPU::setScroll(uint8_t scroll)
     {
+        if (tracing(*this))
+            m_trace->record(PPUTrace::Scroll, scroll);
         if (m_firstWrite)
         {
             m_tempAddress &= ~0x1f;
@@ -458,19 +564,22 @@ namespace NESemu
     {
         if (addr < 0x2000)
         {
-            m_cartridge.m_CHR_ROM[addr] = value;
+            //CHR-RAM is unsupported, CHR-ROM is read only
         }
         else if (addr < 0x3eff) //Name tables upto 0x3000, then mirrored upto 3eff
         {
             auto index = addr & 0x3ff;
             if (addr < 0x2400)      //NT0
-                m_RAM[NameTable0 + index] = value;
+                index += NameTable0;
             else if (addr < 0x2800) //NT1
-                m_RAM[NameTable1 + index] = value;
+                index += NameTable1;
             else if (addr < 0x2c00) //NT2
-                m_RAM[NameTable2 + index] = value;
+                index += NameTable2;
             else                    //NT3
-                m_RAM[NameTable3 + index] = value;
+                index += NameTable3;
+            m_RAM[index] = value;
+            m_dirty |= 1 << (index >> 8);
+            m_forkDirty |= 1 << (index >> 8);
         }
         else if (addr < 0x3fff)
         {
@@ -478,6 +587,8 @@ namespace NESemu
                 m_palette[0] = value;
             else
                 m_palette[addr & 0x1f] = value;
+            m_dirty |= DirtyPalette;
+            m_forkDirty |= DirtyPalette;
        }
     }
 
@@ -0,0 +1,224 @@
+#include "ppustream.hpp"
+#include <cstring>
+#include "transport.hpp"
+
+namespace NESemu
+{
+    void put_ppu_state(uint8_t* p, const PPUSnapshot& s)
+    {
+        std::memcpy(p, s.m_RAM, sizeof(s.m_RAM));
+        p += sizeof(s.m_RAM);
+        std::memcpy(p, s.m_palette, sizeof(s.m_palette));
+        p += sizeof(s.m_palette);
+        std::memcpy(p, s.m_spriteMemory, sizeof(s.m_spriteMemory));
+        p += sizeof(s.m_spriteMemory);
+        std::memcpy(p, s.m_scanlineSprites, sizeof(s.m_scanlineSprites));
+        p += sizeof(s.m_scanlineSprites);
+        *p++ = s.m_scanlineSpriteCount;
+        *p++ = s.m_pipelineState;
+        p = put32(p, s.m_cycle);
+        p = put32(p, s.m_scanline);
+        p = put16(p, s.m_dataAddress);
+        p = put16(p, s.m_tempAddress);
+        p = put16(p, s.m_dataAddrIncrement);
+        *p++ = s.m_fineXScroll;
+        *p++ = s.m_dataBuffer;
+        *p++ = s.m_spriteDataAddress;
+        *p++ = s.m_bgPage;
+        *p++ = s.m_sprPage;
+        put16(p, s.flags);
+    }
+
+    void get_ppu_state(const uint8_t* p, PPUSnapshot& s)
+    {
+        std::memcpy(s.m_RAM, p, sizeof(s.m_RAM));
+        p += sizeof(s.m_RAM);
+        std::memcpy(s.m_palette, p, sizeof(s.m_palette));
+        p += sizeof(s.m_palette);
+        std::memcpy(s.m_spriteMemory, p, sizeof(s.m_spriteMemory));
+        p += sizeof(s.m_spriteMemory);
+        std::memcpy(s.m_scanlineSprites, p, sizeof(s.m_scanlineSprites));
+        p += sizeof(s.m_scanlineSprites);
+        s.m_scanlineSpriteCount = *p++;
+        s.m_pipelineState = *p++;
+        s.m_cycle = int32_t(get32(p));
+        s.m_scanline = int32_t(get32(p + 4));
+        s.m_dataAddress = get16(p + 8);
+        s.m_tempAddress = get16(p + 10);
+        s.m_dataAddrIncrement = get16(p + 12);
+        p += 14;
+        s.m_fineXScroll = *p++;
+        s.m_dataBuffer = *p++;
+        s.m_spriteDataAddress = *p++;
+        s.m_bgPage = *p++;
+        s.m_sprPage = *p++;
+        s.flags = get16(p);
+    }
+
+    void put_varint(std::vector<uint8_t>& out, uint32_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(uint8_t(value) | 0x80);
+            value >>= 7;
+        }
+        out.push_back(value);
+    }
+
+    bool get_varint(const uint8_t*& p, const uint8_t* end, uint32_t& value)
+    {
+        value = 0;
+        for (int shift = 0; p < end && shift < 35; shift += 7)
+        {
+            uint8_t byte = *p++;
+            value |= uint32_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    void encode_state_delta(const uint8_t* base, const uint8_t* state, std::vector<uint8_t>& out)
+    {
+        int i = 0;
+        while (i < PPUStateSize)
+        {
+            int start = i;
+            while (i < PPUStateSize && base[i] == state[i])
+                ++i;
+            if (i == PPUStateSize)
+                break;
+            int changed = i, gap = 0;
+            for (; i < PPUStateSize && gap <= RunMergeGap; ++i)
+                gap = base[i] == state[i] ? gap + 1 : 0;
+            i -= gap;
+            put_varint(out, changed - start);
+            put_varint(out, i - changed);
+            out.insert(out.end(), state + changed, state + i);
+        }
+    }
+
+    bool decode_state_delta(const uint8_t* delta, std::size_t size, const uint8_t* base, uint8_t* state)
+    {
+        std::memcpy(state, base, PPUStateSize);
+        const uint8_t* end = delta + size;
+        uint32_t offset = 0;
+        while (delta < end)
+        {
+            uint32_t skip, length;
+            if (!get_varint(delta, end, skip) || !get_varint(delta, end, length) ||
+                skip > PPUStateSize - offset || length > PPUStateSize - offset - skip || length > uint32_t(end - delta))
+                return false;
+            offset += skip;
+            std::memcpy(state + offset, delta, length);
+            offset += length;
+            delta += length;
+        }
+        return true;
+    }
+
+    PPUTrace::PPUTrace() :
+        m_dot(0),
+        m_lastDot(0),
+        m_count(0),
+        m_pictureDone(false)
+    {
+        m_events.reserve(1024);
+    }
+
+    void PPUTrace::begin()
+    {
+        m_dot = m_lastDot = m_count = 0;
+        m_pictureDone = false;
+        m_events.clear();
+    }
+
+    void PPUTrace::record(Kind kind, uint8_t value)
+    {
+        put_varint(m_events, m_dot - m_lastDot);
+        m_lastDot = m_dot;
+        m_events.push_back(kind);
+        if (kind < StatusRead)
+            m_events.push_back(value);
+        ++m_count;
+    }
+
+    void PPUTrace::record_dma(const uint8_t* page)
+    {
+        record(Dma);
+        m_events.insert(m_events.end(), page, page + 256);
+    }
+
+    // a picture takes the pre-render line and the visible ones
+    const uint32_t ReplayDots = ScanlineCycleLength * (VisibleScanlines + 2);
+
+    bool PPUTrace::replay(PPU& ppu, const uint8_t* events, std::size_t size)
+    {
+        // the recording PPU is ours from here on, it must not record itself again
+        PPUTrace* trace = ppu.m_trace;
+        ppu.m_trace = nullptr;
+        const uint8_t* end = events + size;
+        const uint8_t* p = events;
+        uint32_t dot = 0, at = 0;
+        bool ok = true;
+        while (ok && p < end)
+        {
+            uint32_t delta;
+            if (!get_varint(p, end, delta) || p == end || delta > ReplayDots - at)
+            {
+                ok = false;
+                break;
+            }
+            at += delta;
+            uint8_t kind = *p++;
+            std::size_t length = kind == Dma ? 256 : (kind < StatusRead ? 1 : 0);
+            if (kind > Dma || length > std::size_t(end - p))
+            {
+                ok = false;
+                break;
+            }
+            for (; dot < at; ++dot)
+                ppu.step();
+            switch (kind)
+            {
+                case Control:     ppu.control(*p); break;
+                case Mask:        ppu.setMask(*p); break;
+                case OAMAddress:  ppu.setOAMAddress(*p); break;
+                case OAMData:     ppu.setOAMData(*p); break;
+                case DataAddress: ppu.setDataAddress(*p); break;
+                case Scroll:      ppu.setScroll(*p); break;
+                case Data:        ppu.setData(*p); break;
+                case StatusRead:  ppu.getStatus(); break;
+                case DataRead:    ppu.getData(); break;
+                case Dma:         ppu.doDMA(p); break;
+            }
+            p += length;
+        }
+        while (ok && ppu.m_pipelineState != PPU::PostRender && dot++ < ReplayDots)
+            ppu.step();
+        ppu.m_trace = trace;
+        return ok && ppu.m_pipelineState == PPU::PostRender;
+    }
+
+    bool StateRenderer::load(const std::string& rom)
+    {
+        return m_console.load(rom);
+    }
+
+    bool StateRenderer::render(const PPUSnapshot& start, const uint8_t* events, std::size_t size, uint8_t* matrix)
+    {
+        // anything else could make the renderer index outside its buffers
+        if (start.m_pipelineState != PPU::PreRender || start.m_scanline != 0 || start.m_cycle < 0 ||
+            start.m_cycle > ScanlineCycleLength || start.m_scanlineSpriteCount > 8)
+            return false;
+        for (int i = 0; i < start.m_scanlineSpriteCount; ++i)
+            if (start.m_scanlineSprites[i] >= 64)
+                return false;
+        PPU& ppu = m_console.m_ppu;
+        ppu.load(start);
+        if (!PPUTrace::replay(ppu, events, size))
+            return false;
+        std::memcpy(matrix, ppu.m_pictureBuffer.data(), ScreenSize);
+        return true;
+    }
+}
@@ -0,0 +1,55 @@
+#include "ratecontrol.hpp"
+#include <algorithm>
+
+namespace NESemu
+{
+    RateControl::RateControl() :
+        m_enabled(false),
+        m_level(0),
+        m_clearReports(0),
+        m_backoff(1),
+        m_probing(false),
+        m_frames(0)
+    {}
+
+    bool RateControl::report(double loss, uint32_t queueDelayUs, std::chrono::steady_clock::time_point now)
+    {
+        if (!m_enabled)
+            return false;
+        m_lastReport = now;
+        if (loss > CongestedLoss || queueDelayUs > CongestedDelayUs)
+        {
+            m_clearReports = 0;
+            if (m_level == MaxLevel || now - m_lastChange < std::chrono::milliseconds(HoldMs))
+                return false;
+            if (m_probing && now - m_lastChange < std::chrono::milliseconds(ClearReports * ReportIntervalMs))
+                m_backoff = std::min(m_backoff * 2, MaxBackoff);
+            m_probing = false;
+            ++m_level;
+        }
+        else
+        {
+            if (++m_clearReports < ClearReports * m_backoff || m_level == 0)
+                return false;
+            m_clearReports = 0;
+            m_probing = true;
+            if (--m_level == 0)
+                m_backoff = 1;
+        }
+        m_lastChange = now;
+        return true;
+    }
+
+    bool RateControl::checkSilence(std::chrono::steady_clock::time_point now)
+    {
+        if (!m_enabled || m_lastReport == std::chrono::steady_clock::time_point() ||
+            now - m_lastReport < std::chrono::milliseconds(ReportSilenceMs))
+            return false;
+        return report(1, 0, now);
+    }
+
+    bool RateControl::sendThis()
+    {
+        return m_frames++ % frameDivisor() == 0;
+    }
+}
@@ -0,0 +1,206 @@
+#include "rewind.hpp"
+#include "nes.hpp"
+#include <algorithm>
+#include <iostream>
+
+namespace NESemu
+{
+    const int RewindStatInterval = 600;
+
+    static void encode_xor(const uint8_t* base, const uint8_t* state, std::vector<uint8_t>& out)
+    {
+        auto x = [base, state](int i){ return uint8_t(base ? state[i] ^ base[i] : state[i]); };
+        int i = 0;
+        while (i < SaveStateSize)
+        {
+            int start = i;
+            while (i < SaveStateSize && !x(i))
+                ++i;
+            if (i == SaveStateSize)
+                break;
+            int changed = i, gap = 0;
+            for (; i < SaveStateSize && gap <= RunMergeGap; ++i)
+                gap = x(i) ? 0 : gap + 1;
+            i -= gap;
+            put_varint(out, changed - start);
+            put_varint(out, i - changed);
+            for (int j = changed; j < i; ++j)
+                out.push_back(x(j));
+        }
+    }
+
+    static bool apply_xor(const std::vector<uint8_t>& delta, uint8_t* state)
+    {
+        const uint8_t* p = delta.data();
+        const uint8_t* end = p + delta.size();
+        uint32_t offset = 0;
+        while (p < end)
+        {
+            uint32_t skip, length;
+            if (!get_varint(p, end, skip) || !get_varint(p, end, length) || skip > SaveStateSize - offset ||
+                length > SaveStateSize - offset - skip || length > uint32_t(end - p))
+                return false;
+            offset += skip;
+            for (uint32_t i = 0; i < length; ++i)
+                state[offset++] ^= *p++;
+        }
+        return true;
+    }
+
+    Rewind::Rewind(NES& nes) :
+        m_nes(nes),
+        m_enabled(false),
+        m_budget(0),
+        m_interval(1),
+        m_frame(0),
+        m_inputBase(0),
+        m_bytes(0),
+        m_sinceKey(0),
+        m_statFrames(0),
+        m_statKeyBytes(0),
+        m_statDeltaBytes(0),
+        m_statKeys(0),
+        m_statDeltas(0)
+    {}
+
+    void Rewind::start(std::size_t budgetBytes, int interval)
+    {
+        m_enabled = true;
+        m_budget = budgetBytes;
+        m_interval = std::max(1, std::min(interval, MaxRewindInterval));
+        m_last.assign(SaveStateSize, 0);
+        m_state.assign(SaveStateSize, 0);
+        std::cout << "rewind: " << m_budget / 1024 << " KB, a snapshot every " << m_interval
+                  << " frames, hold backspace to rewind" << std::endl;
+    }
+
+    void Rewind::record()
+    {
+        ++m_frame;
+        if (m_inputs.empty())
+            m_inputBase = m_frame;
+        m_inputs.push_back(m_nes.m_controller1.m_latched | m_nes.m_controller2.m_netKeyState << 8);
+        m_bytes += sizeof(uint16_t);
+
+        if (m_frame % m_interval == 0)
+        {
+            uint32_t start = timestamp_us();
+            Snapshot s;
+            m_nes.saveState(s);
+            put_save_state(m_state.data(), s, m_nes.m_romHash);
+            bool key = m_entries.empty() || m_sinceKey + 1 >= RewindKeyInterval;
+            m_entries.push_back({m_frame, key, {}});
+            Entry& entry = m_entries.back();
+            encode_xor(key ? nullptr : m_last.data(), m_state.data(), entry.m_data);
+            entry.m_data.shrink_to_fit();
+            m_last.swap(m_state);
+            m_bytes += sizeof(Entry) + entry.m_data.size();
+            m_sinceKey = key ? 0 : m_sinceKey + 1;
+            (key ? m_statKeyBytes : m_statDeltaBytes) += entry.m_data.size();
+            ++(key ? m_statKeys : m_statDeltas);
+
+            // over budget: the oldest keyframe goes with its deltas, the newest group always stays
+            while (m_bytes > m_budget)
+            {
+                auto next = std::find_if(m_entries.begin() + 1, m_entries.end(), [](const Entry& e){ return e.m_key; });
+                if (next == m_entries.end())
+                    break;
+                for (auto it = m_entries.begin(); it != next; ++it)
+                    m_bytes -= sizeof(Entry) + it->m_data.size();
+                m_entries.erase(m_entries.begin(), next);
+                // re-simulation starts after the oldest snapshot
+                while (!m_inputs.empty() && m_inputBase <= m_entries.front().m_frame)
+                {
+                    m_inputs.pop_front();
+                    m_bytes -= sizeof(uint16_t);
+                    ++m_inputBase;
+                }
+            }
+            m_snapshotTime.add(timestamp_us() - start);
+        }
+
+        if (++m_statFrames == RewindStatInterval)
+            report();
+    }
+
+    void Rewind::seek(uint32_t frame)
+    {
+        if (m_entries.empty())
+            return;
+        uint32_t start = timestamp_us();
+        frame = std::max(m_entries.front().m_frame, std::min(frame, m_frame));
+        std::size_t newest = m_entries.size() - 1;
+        while (m_entries[newest].m_frame > frame)
+            --newest;
+        std::size_t key = newest;
+        while (!m_entries[key].m_key)
+            --key;
+
+        std::fill(m_state.begin(), m_state.end(), 0);
+        for (std::size_t i = key; i <= newest; ++i)
+            apply_xor(m_entries[i].m_data, m_state.data());
+        Snapshot s;
+        std::string error;
+        if (!get_save_state(m_state.data(), m_state.size(), m_nes.m_romHash, s, error))
+        {
+            std::cerr << "rewind: " << error << std::endl;
+            return;
+        }
+        m_nes.loadState(s);
+
+        // what follows the snapshot goes, recording continues from it
+        while (m_entries.size() > newest + 1)
+        {
+            m_bytes -= sizeof(Entry) + m_entries.back().m_data.size();
+            m_entries.pop_back();
+        }
+        m_last = m_state;
+        m_sinceKey = newest - key;
+
+        // the recorded inputs through both ports, as the rollback does
+        Controller* controller1 = m_nes.m_cpu.m_controller1;
+        Controller* controller2 = m_nes.m_cpu.m_controller2;
+        m_ports[0].load(s.controller[0]);
+        m_ports[1].load(s.controller[1]);
+        m_nes.m_cpu.m_controller1 = &m_ports[0];
+        m_nes.m_cpu.m_controller2 = &m_ports[1];
+        for (uint32_t f = m_entries[newest].m_frame + 1; f <= frame; ++f)
+        {
+            uint16_t input = m_inputs[f - m_inputBase];
+            m_ports[0].m_netKeyState = input & 0xff;
+            m_ports[1].m_netKeyState = input >> 8;
+            m_nes.emulate_frame();
+        }
+        m_nes.m_cpu.m_controller1 = controller1;
+        m_nes.m_cpu.m_controller2 = controller2;
+        ControllerSnapshot port;
+        m_ports[0].save(port);
+        controller1->load(port);
+        m_ports[1].save(port);
+        controller2->load(port);
+
+        while (!m_inputs.empty() && m_inputBase + m_inputs.size() - 1 > frame)
+        {
+            m_inputs.pop_back();
+            m_bytes -= sizeof(uint16_t);
+        }
+        m_frame = frame;
+        m_seekTime.add(timestamp_us() - start);
+    }
+
+    void Rewind::report()
+    {
+        double seconds = m_entries.empty() ? 0 : (m_frame - m_entries.front().m_frame) / 60.0;
+        std::cout << "rewind: " << seconds << " s of history in " << m_bytes / 1024 << " KB ("
+                  << (seconds > 0 ? m_bytes / 1024 * 60 / seconds : 0) << " KB/min), keyframe "
+                  << (m_statKeys ? m_statKeyBytes / m_statKeys : 0) << " bytes, delta "
+                  << (m_statDeltas ? m_statDeltaBytes / m_statDeltas : 0) << " bytes, "
+                  << m_snapshotTime.summary("snapshot", 1, "us");
+        if (m_seekTime.count())
+            std::cout << ", " << m_seekTime.summary("seek", 1, "us");
+        std::cout << std::endl;
+        m_seekTime.clear();
+        m_statFrames = m_statKeys = m_statDeltas = 0;
+        m_statKeyBytes = m_statDeltaBytes = 0;
+    }
+}
@@ -0,0 +1,229 @@
+#include "rollback.hpp"
+#include "nes.hpp"
+#include <algorithm>
+#include <iostream>
+
+namespace NESemu
+{
+    const int StatInterval = 300;
+    // type, confirmed frame, first frame, count
+    const int RollbackHeaderSize = 1 + 4 + 4 + 1;
+    // after the inputs: hashed frame, hash
+    const int RollbackHashSize = 4 + 8;
+
+    Rollback::Rollback(NES& nes) :
+        m_nes(nes),
+        m_enabled(false),
+        m_inputDelay(0),
+        m_local(0),
+        m_frame(0),
+        m_remoteConfirmed(-1),
+        m_peerConfirmed(-1),
+        m_rollbackFrom(-1),
+        m_snapshots(MaxRollback + 2),
+        m_hashes(),
+        m_peerHashes(),
+        m_peerHashNewest(-1),
+        m_checked(-1),
+        m_lastMatched(-1),
+        m_desynced(false),
+        m_statFrames(0),
+        m_statRollbacks(0),
+        m_statResimulated(0),
+        m_statStalls(0),
+        m_statSave(0),
+        m_statLoad(0),
+        m_statHash(0)
+    {}
+
+    void Rollback::start(int inputDelay)
+    {
+        m_enabled = true;
+        m_inputDelay = std::max(0, std::min(inputDelay, MaxInputDelay));
+        m_local = m_nes.m_netplug.m_server ? 0 : 1;
+        std::fill(m_localInput, m_localInput + InputRing, 0);
+        std::fill(m_remoteInput, m_remoteInput + InputRing, 0);
+        std::fill(m_predicted, m_predicted + InputRing, 0);
+        std::fill(m_peerHashFrames, m_peerHashFrames + InputRing, -1);
+
+        m_nes.m_cpu.m_controller1 = &m_ports[0];
+        m_nes.m_cpu.m_controller2 = &m_ports[1];
+        std::cout << "rollback: player " << m_local + 1 << ", input delay " << m_inputDelay << std::endl;
+    }
+
+    void Rollback::update()
+    {
+        receive_inputs();
+
+        if (m_rollbackFrom >= 0)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            m_nes.loadState(m_snapshots[m_rollbackFrom % m_snapshots.size()]);
+            m_statLoad += std::chrono::high_resolution_clock::now() - start;
+            ++m_statRollbacks;
+
+            int now = m_frame;
+            for (m_frame = m_rollbackFrom; m_frame < now; ++m_frame)
+            {
+                run_frame(m_frame);
+                ++m_statResimulated;
+            }
+            m_rollbackFrom = -1;
+        }
+        check_hash();
+
+        // too far ahead of the peer: wait instead of predicting further
+        if (m_frame - m_remoteConfirmed > MaxRollback)
+        {
+            ++m_statStalls;
+            send_inputs(false);
+            return;
+        }
+
+        m_localInput[(m_frame + m_inputDelay) % InputRing] = m_nes.m_controller1.poll();
+        send_inputs(true);
+        run_frame(m_frame++);
+
+        if (++m_statFrames == StatInterval)
+        {
+            using std::chrono::duration_cast;
+            using std::chrono::nanoseconds;
+            std::cout << "rollback: " << m_statRollbacks << " rollbacks, "
+                      << m_statResimulated << " frames re-simulated, "
+                      << m_statStalls << " stalls, save "
+                      << duration_cast<nanoseconds>(m_statSave).count() / (m_statFrames + m_statResimulated)
+                      << " ns, load "
+                      << (m_statRollbacks ? duration_cast<nanoseconds>(m_statLoad).count() / m_statRollbacks : 0)
+                      << " ns, hash " << duration_cast<nanoseconds>(m_statHash).count() / (m_statFrames + m_statResimulated)
+                      << " ns, states match up to frame " << m_lastMatched << std::endl;
+            m_statFrames = m_statRollbacks = m_statResimulated = m_statStalls = 0;
+            m_statSave = m_statLoad = m_statHash = {};
+        }
+    }
+
+    void Rollback::run_frame(int frame)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        m_nes.saveState(m_snapshots[frame % m_snapshots.size()]);
+        auto saved = std::chrono::high_resolution_clock::now();
+        m_statSave += saved - start;
+        m_hashes[frame % InputRing] = m_hasher.update(m_nes.m_cpu, m_nes.m_ppu);
+        m_statHash += std::chrono::high_resolution_clock::now() - saved;
+
+        uint8_t remote = 0;
+        if (frame <= m_remoteConfirmed)
+            remote = m_remoteInput[frame % InputRing];
+        else if (m_remoteConfirmed >= 0)
+            remote = m_remoteInput[m_remoteConfirmed % InputRing]; // predict: the player keeps holding
+        m_predicted[frame % InputRing] = remote;
+
+        m_ports[m_local].m_netKeyState = m_localInput[frame % InputRing];
+        m_ports[1 - m_local].m_netKeyState = remote;
+        m_nes.emulate_frame();
+    }
+
+    int Rollback::final_frame() const
+    {
+        // the start of frame f depends on the inputs of frames before it
+        int frame = std::min(m_frame - 1, m_remoteConfirmed + 1);
+        if (m_rollbackFrom >= 0)
+            frame = std::min(frame, m_rollbackFrom);
+        return frame;
+    }
+
+    void Rollback::check_hash()
+    {
+        // frames the peer hashed that are final here too, in order; ones it never sent are passed over
+        int last = std::min(final_frame(), m_peerHashNewest);
+        for (int frame = std::max(m_checked + 1, m_frame - InputRing + 1); frame <= last; ++frame)
+        {
+            m_checked = frame;
+            if (m_peerHashFrames[frame % InputRing] != frame)
+                continue;
+            uint64_t ours = m_hashes[frame % InputRing];
+            uint64_t theirs = m_peerHashes[frame % InputRing];
+            if (ours == theirs)
+            {
+                m_lastMatched = frame;
+                m_desynced = false;
+            }
+            else if (!m_desynced)
+            {
+                // the first time since they last agreed
+                std::cerr << "rollback: desync, frame " << frame << " starts from a different state on the peer (ours "
+                          << std::hex << ours << ", theirs " << theirs << std::dec << "), states matched up to frame "
+                          << m_lastMatched << std::endl;
+                m_desynced = true;
+            }
+        }
+    }
+
+    void Rollback::send_inputs(bool written)
+    {
+        // everything from the first input the peer is missing to the newest one we have,
+        // an empty range still carries our acknowledgement
+        int last = m_frame + m_inputDelay - (written ? 0 : 1);
+        int first = std::max(m_peerConfirmed + 1, last - InputRing / 2 + 1);
+        int count = std::max(0, last - first + 1);
+
+        auto& transport = m_nes.m_netplug.m_transport;
+        uint8_t* p = transport.datagram();
+        *p++ = RollbackInput;
+        p = put32(p, m_remoteConfirmed);
+        p = put32(p, first);
+        *p++ = count;
+        for (int frame = first; frame < first + count; ++frame)
+            *p++ = m_localInput[frame % InputRing];
+        int hashed = final_frame();
+        p = put32(p, hashed);
+        uint64_t hash = hashed >= 0 ? m_hashes[hashed % InputRing] : 0;
+        p = put32(p, hash >> 32);
+        put32(p, hash);
+        transport.push(RollbackHeaderSize + count + RollbackHashSize);
+        transport.flush();
+    }
+
+    void Rollback::receive_inputs()
+    {
+        auto& transport = m_nes.m_netplug.m_transport;
+        int received;
+        do
+        {
+            received = transport.receive();
+            for (int i = 0; i < received; ++i)
+            {
+                const Datagram& datagram = transport.m_in[i];
+                const uint8_t* p = datagram.m_data;
+                if (datagram.m_size < RollbackHeaderSize || p[0] != RollbackInput)
+                    continue;
+                int32_t confirmed = get32(p + 1);
+                int32_t first = get32(p + 5);
+                int count = std::min<int>(p[9], datagram.m_size - RollbackHeaderSize);
+                p += RollbackHeaderSize;
+                m_peerConfirmed = std::max<int>(m_peerConfirmed, confirmed);
+                if (datagram.m_size == RollbackHeaderSize + count + RollbackHashSize)
+                {
+                    int32_t hashed = get32(p + count);
+                    if (hashed >= 0)
+                    {
+                        m_peerHashFrames[hashed % InputRing] = hashed;
+                        m_peerHashes[hashed % InputRing] = uint64_t(get32(p + count + 4)) << 32 | get32(p + count + 8);
+                        m_peerHashNewest = std::max(m_peerHashNewest, hashed);
+                    }
+                }
+
+                for (int frame = first; frame < first + count; ++frame)
+                {
+                    uint8_t input = *p++;
+                    if (frame != m_remoteConfirmed + 1)
+                        continue;
+                    m_remoteInput[frame % InputRing] = input;
+                    m_remoteConfirmed = frame;
+                    if (frame < m_frame && m_predicted[frame % InputRing] != input &&
+                        (m_rollbackFrom < 0 || frame < m_rollbackFrom))
+                        m_rollbackFrom = frame;
+                }
+            }
+        } while (received == DatagramBatch); // a partial batch emptied the socket
+    }
+}
@@ -0,0 +1,138 @@
+#include "runahead.hpp"
+#include "nes.hpp"
+#include <algorithm>
+#include <iostream>
+
+namespace NESemu
+{
+    const int RunAheadStatInterval = 300;
+
+    RunAhead::RunAhead(NES& nes) :
+        m_nes(nes),
+        m_enabled(false),
+        m_frames(0),
+        m_inputs{0, 0},
+        m_pending(false),
+        m_running(false),
+        m_workerUs(0),
+        m_statFrames(0)
+    {}
+
+    RunAhead::~RunAhead()
+    {
+        stop();
+    }
+
+    bool RunAhead::start(int frames, bool threaded)
+    {
+        stop();
+        m_frames = std::max(1, std::min(frames, MaxRunAhead));
+        if (!m_console.load(m_nes.m_romPath))
+        {
+            std::cerr << "runahead: load failed... " << m_nes.m_romPath << std::endl;
+            return false;
+        }
+        m_enabled = true;
+        if (threaded)
+        {
+            m_pending = false;
+            m_running = true;
+            m_thread = std::thread(&RunAhead::worker, this);
+        }
+        std::cout << "runahead: " << m_frames << " frames ahead, " << (threaded ? "on a worker" : "serially") << std::endl;
+        return true;
+    }
+
+    void RunAhead::stop()
+    {
+        if (!m_thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_running = false;
+        }
+        m_wake.notify_one();
+        m_thread.join();
+    }
+
+    void RunAhead::begin()
+    {
+        if (!m_thread.joinable())
+            return;
+        uint32_t start = timestamp_us();
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_nes.saveState(m_state);
+            m_inputs[0] = m_nes.m_controller1.m_latched;
+            m_inputs[1] = m_nes.m_controller2.m_netKeyState;
+            m_pending = true;
+        }
+        m_wake.notify_one();
+        m_cost.add(timestamp_us() - start);
+    }
+
+    void RunAhead::finish()
+    {
+        uint32_t start = timestamp_us();
+        if (m_thread.joinable())
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_done.wait(lock, [this]{ return !m_pending; });
+            uint32_t waited = timestamp_us();
+            m_wait.add(waited - start);
+            m_nes.m_screen.setFrame(m_console.m_screen.m_screen_matrix);
+            // the save in begin() was already counted
+            m_cost.add(m_workerUs + timestamp_us() - waited);
+        }
+        else
+        {
+            m_nes.saveState(m_state);
+            m_inputs[0] = m_nes.m_controller1.m_latched;
+            m_inputs[1] = m_nes.m_controller2.m_netKeyState;
+            run();
+            m_nes.m_screen.setFrame(m_console.m_screen.m_screen_matrix);
+            m_cost.add(timestamp_us() - start);
+        }
+
+        if (++m_statFrames == RunAheadStatInterval)
+            report();
+    }
+
+    void RunAhead::run()
+    {
+        m_console.loadState(m_state);
+        m_console.m_ports[0].m_netKeyState = m_inputs[0];
+        m_console.m_ports[1].m_netKeyState = m_inputs[1];
+        for (int i = 0; i < m_frames; ++i)
+            m_console.emulate_frame();
+    }
+
+    void RunAhead::worker()
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        for (;;)
+        {
+            m_wake.wait(lock, [this]{ return m_pending || !m_running; });
+            if (!m_running)
+                return;
+            // m_state is ours until m_pending is cleared
+            lock.unlock();
+            uint32_t start = timestamp_us();
+            run();
+            uint32_t took = timestamp_us() - start;
+            lock.lock();
+            m_workerUs = took;
+            m_pending = false;
+            m_done.notify_one();
+        }
+    }
+
+    void RunAhead::report()
+    {
+        std::cout << "runahead: " << m_frames << " frames, " << m_cost.summary("extra CPU/frame", 1, "us");
+        if (m_thread.joinable())
+            std::cout << ", " << m_wait.summary("waiting for the worker", 1, "us");
+        std::cout << std::endl;
+        m_statFrames = 0;
+    }
+}
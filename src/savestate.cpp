@@ -0,0 +1,177 @@
+#include "savestate.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include "ppu.hpp"
+#include "ppustream.hpp"
+#include "transport.hpp"
+
+namespace NESemu
+{
+    const int SaveStateSize = SaveStateHeaderSize + CPUStateSize + PPUStateSize + 2 * ControllerStateSize;
+
+    uint32_t rom_hash(const Cartridge& cartridge)
+    {
+        uint32_t hash = 2166136261u;
+        for (const auto* rom : {&cartridge.m_PRG_ROM, &cartridge.m_CHR_ROM})
+            for (uint8_t byte : *rom)
+                hash = (hash ^ byte) * 16777619u;
+        return hash;
+    }
+
+    void put_save_state(uint8_t* p, const Snapshot& s, uint32_t romHash)
+    {
+        p = put32(p, SaveStateMagic);
+        p = put16(p, SaveStateVersion);
+        *p++ = 0;   // mapper
+        *p++ = 0;
+        p = put32(p, romHash);
+        p = put32(p, 0);
+
+        const CPUSnapshot& cpu = s.cpu;
+        p = put16(p, cpu.r_PC);
+        *p++ = cpu.r_SP;
+        *p++ = cpu.r_A;
+        *p++ = cpu.r_X;
+        *p++ = cpu.r_Y;
+        *p++ = cpu.flags;
+        p = put32(p, cpu.m_skipCycles);
+        p = put32(p, cpu.m_cycles);
+        std::memcpy(p, cpu.m_RAM, sizeof(cpu.m_RAM));
+        p += sizeof(cpu.m_RAM);
+
+        put_ppu_state(p, s.ppu);
+        p += PPUStateSize;
+
+        for (const auto& controller : s.controller)
+        {
+            *p++ = controller.m_flag;
+            p = put32(p, controller.m_keyStates);
+            p = put32(p, controller.m_netKeyState);
+        }
+    }
+
+    bool get_save_state(const uint8_t* p, std::size_t size, uint32_t romHash, Snapshot& s, std::string& error)
+    {
+        if (size < std::size_t(SaveStateHeaderSize) || get32(p) != SaveStateMagic)
+            error = "not a save state";
+        else if (get16(p + 4) != SaveStateVersion)
+            error = "version " + std::to_string(get16(p + 4)) + ", this build reads " + std::to_string(SaveStateVersion);
+        else if (p[6] != 0 || get32(p + 12) != 0)
+            error = "saved with a mapper this build does not have";
+        else if (get32(p + 8) != romHash)
+            error = "saved from another ROM";
+        else if (size != std::size_t(SaveStateSize))
+            error = "truncated";
+        if (!error.empty())
+            return false;
+        p += SaveStateHeaderSize;
+
+        CPUSnapshot& cpu = s.cpu;
+        cpu.r_PC = get16(p);
+        cpu.r_SP = p[2];
+        cpu.r_A = p[3];
+        cpu.r_X = p[4];
+        cpu.r_Y = p[5];
+        cpu.flags = p[6];
+        cpu.m_skipCycles = int32_t(get32(p + 7));
+        cpu.m_cycles = int32_t(get32(p + 11));
+        p += 15;
+        std::memcpy(cpu.m_RAM, p, sizeof(cpu.m_RAM));
+        p += sizeof(cpu.m_RAM);
+
+        get_ppu_state(p, s.ppu);
+        p += PPUStateSize;
+
+        for (auto& controller : s.controller)
+        {
+            controller.m_flag = p[0];
+            controller.m_keyStates = get32(p + 1);
+            controller.m_netKeyState = get32(p + 5);
+            p += ControllerStateSize;
+        }
+
+        // the PPU indexes its buffers with these
+        const PPUSnapshot& ppu = s.ppu;
+        bool valid = ppu.m_pipelineState <= PPU::VerticalBlank && ppu.m_scanlineSpriteCount <= 8 &&
+                     ppu.m_cycle >= 0 && ppu.m_cycle <= ScanlineCycleLength &&
+                     ppu.m_scanline >= 0 && ppu.m_scanline <= FrameEndScanline;
+        for (int i = 0; valid && i < ppu.m_scanlineSpriteCount; ++i)
+            valid = ppu.m_scanlineSprites[i] < 64;
+        if (!valid)
+            error = "PPU state out of range";
+        return valid;
+    }
+
+    bool read_state_file(const std::string& path, std::vector<uint8_t>& data)
+    {
+        std::ifstream file(path, std::ios_base::binary | std::ios_base::in);
+        if (!file)
+            return false;
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    StateWriter::StateWriter() :
+        m_running(false),
+        m_pending(false)
+    {}
+
+    StateWriter::~StateWriter()
+    {
+        stop();
+    }
+
+    void StateWriter::write(const std::string& path, const uint8_t* data, std::size_t size)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_path = path;
+            m_data.assign(data, data + size);
+            m_pending = true;
+            if (!m_running)
+            {
+                m_running = true;
+                m_thread = std::thread(&StateWriter::worker, this);
+            }
+        }
+        m_wake.notify_one();
+    }
+
+    void StateWriter::stop()
+    {
+        if (!m_thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_running = false;
+        }
+        m_wake.notify_one();
+        m_thread.join();
+    }
+
+    void StateWriter::worker()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            m_wake.wait(lock, [this]{ return m_pending || !m_running; });
+            if (!m_pending) // stopped and drained
+                break;
+            std::string path = m_path;
+            m_writing.swap(m_data);
+            m_pending = false;
+            lock.unlock();
+
+            std::string temp = path + ".tmp";
+            std::ofstream file(temp, std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
+            file.write(reinterpret_cast<const char*>(m_writing.data()), m_writing.size());
+            file.close();
+            if (!file || std::rename(temp.c_str(), path.c_str()) != 0)
+                std::cerr << "state: write failed... " << path << std::endl;
+
+            lock.lock();
+        }
+    }
+}
@@ -1,8 +1,10 @@
 #include "screen.hpp"
+#include <algorithm>
+#include <cstring>
 
 namespace NESemu
 {
-    const std::uint32_t colormap[] = {
+    const std::uint32_t colormap[64] = {
         0x666666ff, 0x002a88ff, 0x1412a7ff, 0x3b00a4ff, 0x5c007eff, 0x6e0040ff, 0x6c0600ff, 0x561d00ff,
         0x333500ff, 0x0b4800ff, 0x005200ff, 0x004f08ff, 0x00404dff, 0x000000ff, 0x000000ff, 0x000000ff,
         
@@ -21,11 +23,11 @@ namespace NESemu
         m_screenSize = {w, h};
         m_vertices.setPrimitiveType(sf::Triangles);
         m_pixelSize = pixel_size;
-        for (std::size_t x = 0; x < w; ++x)
+        for (std::size_t y = 0; y < h; ++y)
         {
-            for (std::size_t y = 0; y < h; ++y)
+            for (std::size_t x = 0; x < w; ++x)
             {
-                auto index = (x * m_screenSize.y + y) * 6;
+                auto index = (y * m_screenSize.x + x) * 6;
                 sf::Vector2f coord2d (x * m_pixelSize, y * m_pixelSize);
 
                 //Triangle-1
@@ -59,14 +61,12 @@ namespace NESemu
 
     void Screen::setPixel(std::size_t x, std::size_t y, uint8_t palette_color)
     {
-        m_screen_matrix[x*240 + y] = palette_color;
+        m_screen_matrix[y*256 + x] = palette_color;
         auto color = static_cast<sf::Color>(colormap[palette_color]);
-        auto index = (x * m_screenSize.y + y) * 6;
+        auto index = (y * m_screenSize.x + x) * 6;
         if (index >= m_vertices.getVertexCount())
             return;
 
-        sf::Vector2f coord2d (x * m_pixelSize, y * m_pixelSize);
-
         //Triangle-1
         //top-left
         m_vertices[index].color    = color;
@@ -88,6 +88,24 @@ namespace NESemu
         m_vertices[index + 5].color = color;
     }
 
+    void Screen::setFrame(const uint8_t* frame)
+    {
+        std::memcpy(m_screen_matrix, frame, sizeof(m_screen_matrix));
+        refresh();
+    }
+
+    void Screen::refresh()
+    {
+        // walk the matrix and the vertex array in the same (scanline) order
+        auto count = std::min<std::size_t>(sizeof(m_screen_matrix), m_vertices.getVertexCount() / 6);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            auto color = static_cast<sf::Color>(colormap[m_screen_matrix[i]]);
+            for (std::size_t v = i * 6; v < i * 6 + 6; ++v)
+                m_vertices[v].color = color;
+        }
+    }
+
     void Screen::draw(sf::RenderTarget& target, sf::RenderStates states) const
     {
         target.draw(m_vertices, states);
@@ -0,0 +1,360 @@
+#include "server.hpp"
+#include <algorithm>
+#include <csignal>
+#include <iostream>
+
+namespace NESemu
+{
+    const auto ServerFrame = std::chrono::microseconds(1'000'000 / 60);
+
+    static int64_t now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    Session::Session(uint32_t id, const ServerOptions& options) :
+        m_id(id),
+        m_joined{false, false},
+        m_addr{0, 0},
+        m_port{0, 0},
+        m_lastSeen(now_ms()),
+        m_running(false),
+        m_closed(false),
+        m_home(0)
+    {
+        for (auto& player : m_players)
+        {
+            player.reset(new Netplug(true, "", 0));
+            player->m_verbose = false;
+            player->m_delta = options.m_delta;
+            player->m_pack = options.m_pack;
+            player->m_fecGroup = fec_group(options.m_fecGroup);
+            player->m_rate.m_enabled = options.m_adaptive;
+        }
+    }
+
+    bool Session::join(int player, const Transport& socket, uint32_t addr, uint16_t port)
+    {
+        if (m_joined[player].load(std::memory_order_acquire))
+            return isFrom(player, addr, port);
+        if (!m_players[player]->m_transport.attach(socket, addr, port))
+            return false;
+        m_addr[player] = addr;
+        m_port[player] = port;
+        m_joined[player].store(true, std::memory_order_release);
+        return true;
+    }
+
+    bool Session::isFrom(int player, uint32_t addr, uint16_t port) const
+    {
+        return m_joined[player].load(std::memory_order_acquire) && m_addr[player] == addr && m_port[player] == port;
+    }
+
+    void Session::run_frame()
+    {
+        bool joined[2] = {m_joined[0].load(std::memory_order_acquire), m_joined[1].load(std::memory_order_acquire)};
+        for (int p = 0; p < 2; ++p)
+        {
+            if (joined[p])
+                m_players[p]->receive_controller_state(m_console.m_ports[p]);
+        }
+        m_console.emulate_frame();
+        for (int p = 0; p < 2; ++p)
+        {
+            if (joined[p])
+                m_players[p]->send_screen(m_console.m_screen);
+        }
+    }
+
+    WorkerPool::WorkerPool() :
+        m_pending(0),
+        m_stopping(false),
+        m_statJobs(0),
+        m_statSteals(0),
+        m_statBusyUs(0),
+        m_statLateUs(0)
+    {}
+
+    WorkerPool::~WorkerPool()
+    {
+        stop();
+    }
+
+    void WorkerPool::start(int threads)
+    {
+        m_stopping = false;
+        for (int i = 0; i < threads; ++i)
+            m_queues.emplace_back(new Queue);
+        for (int i = 0; i < threads; ++i)
+            m_threads.emplace_back(&WorkerPool::work, this, i);
+    }
+
+    void WorkerPool::stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_idleLock);
+            m_stopping = true;
+        }
+        m_idle.notify_all();
+        for (auto& thread : m_threads)
+            thread.join();
+        m_threads.clear();
+        m_queues.clear();
+        m_pending = 0;
+    }
+
+    void WorkerPool::submit(Job job, int home)
+    {
+        {
+            Queue& queue = *m_queues[home % m_queues.size()];
+            std::lock_guard<std::mutex> lock(queue.m_lock);
+            queue.m_jobs.push_back(std::move(job));
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_idleLock);
+            ++m_pending;
+        }
+        m_idle.notify_one();
+    }
+
+    // a job is known to be queued somewhere: our oldest, else another worker's newest
+    WorkerPool::Job WorkerPool::take(int index)
+    {
+        int count = m_queues.size();
+        for (int i = 0; ; i = (i + 1) % count)
+        {
+            Queue& queue = *m_queues[(index + i) % count];
+            std::lock_guard<std::mutex> lock(queue.m_lock);
+            if (queue.m_jobs.empty())
+                continue;
+            Job job;
+            if (i == 0)
+            {
+                job = std::move(queue.m_jobs.front());
+                queue.m_jobs.pop_front();
+            }
+            else
+            {
+                job = std::move(queue.m_jobs.back());
+                queue.m_jobs.pop_back();
+                ++m_statSteals;
+            }
+            return job;
+        }
+    }
+
+    void WorkerPool::work(int index)
+    {
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_idleLock);
+                m_idle.wait(lock, [this]{ return m_pending > 0 || m_stopping; });
+                if (m_stopping)
+                    return;
+                --m_pending;
+            }
+            Job session = take(index);
+            auto start = Clock::now();
+            m_statLateUs += std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(
+                start - session->m_due).count());
+            session->run_frame();
+            m_statBusyUs += std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+            ++m_statJobs;
+            session->m_running.store(false, std::memory_order_release);
+        }
+    }
+
+    Server::Server(unsigned short port, int threads, const std::vector<std::string>& roms, const ServerOptions& options) :
+        m_port(port),
+        m_threads(std::max(1, threads)),
+        m_roms(roms),
+        m_options(options),
+        m_running(false),
+        m_nextHome(0),
+        m_statFrames(0),
+        m_statSkipped(0),
+        m_lastJobs(0),
+        m_lastSteals(0),
+        m_lastBusyUs(0),
+        m_lastLateUs(0)
+    {}
+
+    Server::~Server()
+    {
+        m_running = false;
+        if (m_receiver.joinable())
+            m_receiver.join();
+        m_pool.stop();
+    }
+
+    static Server* g_server = nullptr;
+
+    bool Server::run()
+    {
+        if (!m_transport.open(m_port, "", 0) || !m_transport.isNative())
+        {
+            std::cerr << "server: needs a native socket on port " << m_port << std::endl;
+            return false;
+        }
+        std::cout << "server port : " << m_port << ", " << m_threads << " workers, " << m_roms.size() << " roms"
+                  << std::endl;
+        g_server = this;
+        std::signal(SIGINT, [](int){ if (g_server) g_server->stop(); });
+
+        m_running = true;
+        m_pool.start(m_threads);
+        m_receiver = std::thread(&Server::receive_loop, this);
+        m_lastStat = Clock::now();
+        while (m_running)
+        {
+            auto now = Clock::now();
+            schedule(now);
+            report(now);
+
+            auto next = now + ServerFrame;
+            for (auto& session : m_sessions)
+                next = std::min(next, session->m_deadline);
+            std::this_thread::sleep_until(next);
+        }
+
+        m_receiver.join();
+        m_pool.stop();
+        g_server = nullptr;
+        std::cout << "server: stopped" << std::endl;
+        return true;
+    }
+
+    // submits every session whose frame is due
+    void Server::schedule(Clock::time_point now)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_newLock);
+            for (auto& session : m_new)
+            {
+                session->m_deadline = now;
+                session->m_home = m_nextHome++ % m_threads;
+                m_sessions.push_back(std::move(session));
+            }
+            m_new.clear();
+        }
+        m_sessions.erase(std::remove_if(m_sessions.begin(), m_sessions.end(), [](const std::shared_ptr<Session>& s){
+            return s->m_closed && !s->m_running.load(std::memory_order_acquire);
+        }), m_sessions.end());
+
+        for (auto& session : m_sessions)
+        {
+            if (session->m_deadline > now || session->m_closed)
+                continue;
+            if (session->m_running.load(std::memory_order_acquire))
+                ++m_statSkipped; // still on the last frame, this one is dropped
+            else
+            {
+                session->m_running.store(true, std::memory_order_relaxed);
+                session->m_due = session->m_deadline;
+                m_pool.submit(session, session->m_home);
+                ++m_statFrames;
+            }
+            session->m_deadline += ServerFrame;
+            if (session->m_deadline + ServerFrame < now)
+                session->m_deadline = now; // fell far behind, start counting from here
+        }
+    }
+
+    void Server::receive_loop()
+    {
+        auto lastExpire = Clock::now();
+        while (m_running)
+        {
+            if (m_transport.wait(10000))
+            {
+                int count = m_transport.receive();
+                for (int i = 0; i < count; ++i)
+                    demux(m_transport.m_in[i]);
+            }
+
+            auto now = Clock::now();
+            if (now - lastExpire < std::chrono::seconds(1))
+                continue;
+            lastExpire = now;
+            int64_t limit = now_ms() - SessionTimeoutMs;
+            for (auto it = m_byId.begin(); it != m_byId.end();)
+            {
+                if (it->second->m_lastSeen.load(std::memory_order_relaxed) >= limit)
+                {
+                    ++it;
+                    continue;
+                }
+                std::cout << "session " << it->first << " closed" << std::endl;
+                it->second->m_closed = true;
+                it = m_byId.erase(it);
+            }
+        }
+    }
+
+    // [SessionData][session id][player][packet]
+    void Server::demux(const Datagram& datagram)
+    {
+        const uint8_t* data = datagram.m_data;
+        if (datagram.m_size <= SessionHeaderSize || data[0] != SessionData || data[5] > 1)
+            return;
+        uint32_t id = get32(data + 1);
+        int player = data[5];
+        const uint8_t* packet = data + SessionHeaderSize;
+        std::size_t size = datagram.m_size - SessionHeaderSize;
+
+        auto found = m_byId.find(id);
+        if (packet[0] == SessionJoin && size == 2)
+        {
+            if (found == m_byId.end())
+            {
+                if (m_byId.size() >= MaxSessions || packet[1] >= m_roms.size())
+                    return;
+                auto session = std::make_shared<Session>(id, m_options);
+                if (!session->m_console.load(m_roms[packet[1]]))
+                    return;
+                found = m_byId.emplace(id, session).first;
+                std::lock_guard<std::mutex> lock(m_newLock);
+                m_new.push_back(session);
+            }
+            Session& session = *found->second;
+            bool known = session.isFrom(player, datagram.m_addr, datagram.m_port);
+            if (!session.join(player, m_transport, datagram.m_addr, datagram.m_port))
+                return;
+            if (!known)
+            {
+                std::cout << "session " << id << ": player " << player + 1 << " joined from "
+                          << sf::IpAddress(datagram.m_addr).toString() << ":" << datagram.m_port << " ("
+                          << m_byId.size() << " sessions)" << std::endl;
+            }
+            session.m_lastSeen.store(now_ms(), std::memory_order_relaxed);
+            return;
+        }
+        if (found == m_byId.end() || !found->second->isFrom(player, datagram.m_addr, datagram.m_port))
+            return;
+        found->second->m_players[player]->m_transport.deliver(datagram, SessionHeaderSize);
+        found->second->m_lastSeen.store(now_ms(), std::memory_order_relaxed);
+    }
+
+    void Server::report(Clock::time_point now)
+    {
+        auto elapsed = now - m_lastStat;
+        if (elapsed < std::chrono::milliseconds(ServerStatMs))
+            return;
+        double seconds = std::chrono::duration<double>(elapsed).count();
+        uint64_t jobs = m_pool.m_statJobs, steals = m_pool.m_statSteals;
+        uint64_t busy = m_pool.m_statBusyUs, late = m_pool.m_statLateUs;
+        uint64_t done = jobs - m_lastJobs;
+        std::cout << "server: " << m_sessions.size() << " sessions, " << int(m_statFrames / seconds) << " frames/s started, "
+                  << int(done / seconds) << " done, " << m_statSkipped << " skipped, " << steals - m_lastSteals << " steals, frame "
+                  << (done ? (busy - m_lastBusyUs) / done : 0) << " us, start late "
+                  << (done ? (late - m_lastLateUs) / done : 0) << " us, workers "
+                  << int((busy - m_lastBusyUs) / (seconds * 1e6 * m_threads) * 100) << "% busy" << std::endl;
+        m_lastJobs = jobs;
+        m_lastSteals = steals;
+        m_lastBusyUs = busy;
+        m_lastLateUs = late;
+        m_statFrames = m_statSkipped = 0;
+        m_lastStat = now;
+    }
+}
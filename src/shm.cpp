@@ -0,0 +1,173 @@
+#include "shm.hpp"
+#include <cstring>
+#include <iostream>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace NESemu
+{
+    const int ShmStatInterval = 300;
+
+    SharedLink::SharedLink() :
+        m_writer(false),
+        m_fd(-1),
+        m_layout(nullptr),
+        m_frame(0),
+        m_inputSeq(0),
+        m_displayed(0),
+        m_view(ScreenSize),
+        m_statFrames(0),
+        m_statRetries(0),
+        m_statSkipped(0)
+    {}
+
+    SharedLink::~SharedLink()
+    {
+        close();
+    }
+
+    bool SharedLink::open(const std::string& name, bool writer)
+    {
+        close();
+#ifdef __linux__
+        m_path = "/dev/shm/nesemu-" + name;
+        m_writer = writer;
+        // whoever comes first creates it, a zeroed file is a valid empty link
+        m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (m_fd < 0 || ::ftruncate(m_fd, sizeof(ShmLayout)) != 0)
+        {
+            std::cerr << "shm: open failed... " << m_path << std::endl;
+            close();
+            return false;
+        }
+        void* mapping = ::mmap(nullptr, sizeof(ShmLayout), PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            std::cerr << "shm: mmap failed... " << m_path << std::endl;
+            close();
+            return false;
+        }
+        m_layout = static_cast<ShmLayout*>(mapping);
+        if (m_writer)
+        {
+            // a new run: frames of an earlier p1 are gone, p2's mailbox is kept
+            m_layout->m_magic.store(0, std::memory_order_relaxed);
+            m_layout->m_latest.store(0, std::memory_order_relaxed);
+            for (auto& frame : m_layout->m_frames)
+                frame.m_seq.store(0, std::memory_order_relaxed);
+            m_layout->m_version = ShmVersion;
+            m_layout->m_magic.store(ShmMagic, std::memory_order_release);
+            m_inputSeq = 0;
+        }
+        else
+            m_inputSeq = m_layout->m_input.m_input; // p1 sees our numbers go on rising
+        std::cout << "shm: " << m_path << (m_writer ? " (p1)" : "") << std::endl;
+        return true;
+#else
+        (void)name;
+        (void)writer;
+        std::cerr << "shm: shared memory needs Linux" << std::endl;
+        return false;
+#endif
+    }
+
+    void SharedLink::close()
+    {
+#ifdef __linux__
+        if (m_layout)
+            ::munmap(m_layout, sizeof(ShmLayout));
+        if (m_fd >= 0)
+        {
+            ::close(m_fd);
+            if (m_writer)
+                ::unlink(m_path.c_str());
+        }
+#endif
+        m_layout = nullptr;
+        m_fd = -1;
+    }
+
+    void SharedLink::publish(const uint8_t* matrix, uint32_t input)
+    {
+        if (!m_layout)
+            return;
+        ShmFrame& slot = m_layout->m_frames[++m_frame % ShmSlots];
+        uint32_t seq = slot.m_seq.load(std::memory_order_relaxed);
+        slot.m_seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.m_frame = m_frame;
+        slot.m_time = timestamp_us();
+        slot.m_input = input;
+        std::memcpy(slot.m_pixels, matrix, ScreenSize);
+        slot.m_seq.store(seq + 2, std::memory_order_release);
+        m_layout->m_latest.store(m_frame, std::memory_order_release);
+    }
+
+    bool SharedLink::read_input(uint8_t& state, uint32_t& input)
+    {
+        if (!m_layout)
+            return false;
+        const ShmInput& mailbox = m_layout->m_input;
+        for (int attempt = 0; attempt < ShmReadTries; ++attempt)
+        {
+            uint32_t seq = mailbox.m_seq.load(std::memory_order_acquire);
+            if (seq & 1)
+                continue;
+            uint32_t newest = mailbox.m_input;
+            uint8_t newState = mailbox.m_state;
+            uint32_t time = mailbox.m_time;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (mailbox.m_seq.load(std::memory_order_relaxed) != seq)
+                continue;
+            if (newest == m_inputSeq)
+                return false;
+            if (newest > m_inputSeq && m_inputSeq)
+                m_statSkipped += newest - m_inputSeq - 1;
+            m_inputSeq = newest;
+            state = newState;
+            input = newest;
+            m_age.add(int32_t(timestamp_us() - time));
+            if (++m_statFrames == ShmStatInterval)
+                report("input age");
+            return true;
+        }
+        ++m_statRetries;
+        return false;
+    }
+
+    void SharedLink::write_input(uint8_t state)
+    {
+        if (!m_layout)
+            return;
+        ShmInput& mailbox = m_layout->m_input;
+        uint32_t seq = mailbox.m_seq.load(std::memory_order_relaxed);
+        mailbox.m_seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        mailbox.m_input = ++m_inputSeq;
+        mailbox.m_state = state;
+        mailbox.m_displayed = m_displayed;
+        mailbox.m_time = timestamp_us();
+        mailbox.m_seq.store(seq + 2, std::memory_order_release);
+    }
+
+    void SharedLink::viewed(uint32_t frame, uint32_t newerThan, uint32_t time)
+    {
+        m_age.add(int32_t(timestamp_us() - time));
+        if (newerThan && frame > newerThan)
+            m_statSkipped += frame - newerThan - 1;
+        m_displayed = frame;
+        if (++m_statFrames == ShmStatInterval)
+            report("frame age");
+    }
+
+    void SharedLink::report(const char* what)
+    {
+        std::cout << "shm: " << m_age.summary(what, 1, "us") << ", " << m_statSkipped
+                  << (m_writer ? " inputs overwritten" : " frames skipped") << ", "
+                  << m_statRetries << " torn reads retried" << std::endl;
+        m_statFrames = m_statSkipped = m_statRetries = 0;
+    }
+}
@@ -0,0 +1,241 @@
+#include "spectator.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace NESemu
+{
+    const int StatInterval = 300;
+
+    static std::string endpoint(uint32_t addr, uint16_t port)
+    {
+        return sf::IpAddress(addr).toString() + ":" + std::to_string(port);
+    }
+
+    // the XOR of each group of chunks, sent after the group like p2's parity
+    static void make_parity(SharedFrame& shared, int group)
+    {
+        shared.m_fecGroup = group;
+        if (group < 2)
+            return;
+        uint32_t total = shared.m_payload.size();
+        shared.m_parity.assign((shared.m_chunks + group - 1) / group * ChunkSize, 0);
+        for (uint32_t i = 0; i < shared.m_chunks; ++i)
+            xor_into(shared.m_parity.data() + i / group * ChunkSize, shared.m_payload.data() + i * ChunkSize,
+                     std::min<uint32_t>(total - i * ChunkSize, ChunkSize));
+    }
+
+    Spectators::Spectators() :
+        m_open(false),
+        m_next(0),
+        m_key(),
+        m_statFrames(0),
+        m_statKeyframes(0),
+        m_statResyncs(0),
+        m_statDatagrams(0),
+        m_statTime(0)
+    {
+        for (auto& shared : m_frames)
+            shared.m_frame = 0;
+        m_key.m_frame = 0;
+        m_viewers.reserve(MaxViewers);
+    }
+
+    bool Spectators::open(unsigned short port)
+    {
+        m_open = m_transport.open(port, "", 0);
+        if (m_open)
+            std::cout << "spectator port : " << port << std::endl;
+        return m_open;
+    }
+
+    void Spectators::send_frame(const Netplug& netplug, const uint8_t* matrix)
+    {
+        auto start = Clock::now();
+        poll(start);
+        if (m_viewers.empty())
+            return;
+
+        // the frame as p1 sent it to p2, copied once for everyone
+        uint32_t frame = netplug.m_frame;
+        SharedFrame& shared = m_frames[frame % SharedFrames];
+        shared.m_frame = frame;
+        shared.m_type = netplug.m_sentType;
+        shared.m_base = netplug.m_sentBase;
+        shared.m_time = netplug.m_sentTime;
+        shared.m_input = netplug.m_sentInput;
+        shared.m_payload.assign(netplug.m_sentPayload, netplug.m_sentPayload + netplug.m_sentSize);
+        shared.m_chunks = std::max<std::size_t>(1, (shared.m_payload.size() + ChunkSize - 1) / ChunkSize);
+        make_parity(shared, netplug.m_fecGroup);
+        bool isKey = shared.m_type == ScreenKey || shared.m_type == ScreenKeyPacked || shared.m_type == ScreenState;
+
+        for (auto& viewer : m_viewers)
+        {
+            // p2's deltas only decode for a viewer that keeps up, the base is a frame p2 acknowledged
+            bool behind = viewer.m_ackFrame + ScreenHistory / 2 < frame && frame - viewer.m_keyFrame >= KeyRetryFrames;
+            const SharedFrame* next = &shared;
+            if (!isKey && (viewer.m_needKey || behind))
+                next = keyframe(netplug, matrix);
+            if (next != &shared || isKey)
+            {
+                viewer.m_keyFrame = frame;
+                viewer.m_needKey = false;
+            }
+            viewer.m_queue.push_back({next, frame, 0});
+            if (viewer.m_queue.size() > ViewerQueueFrames)
+            {
+                // the viewer can not keep up, skip ahead and restart it from a keyframe
+                viewer.m_queue.pop_front();
+                viewer.m_needKey = true;
+                ++m_statResyncs;
+            }
+        }
+        pump();
+
+        m_statTime += Clock::now() - start;
+        if (++m_statFrames == StatInterval)
+        {
+            std::cout << "spectators: " << m_viewers.size() << " viewers, "
+                      << m_statDatagrams / m_statFrames << " datagrams/frame, fan-out "
+                      << std::chrono::duration_cast<std::chrono::microseconds>(m_statTime).count() / m_statFrames
+                      << " us/frame, " << m_statKeyframes << " keyframes, " << m_statResyncs << " resyncs" << std::endl;
+            m_statFrames = m_statKeyframes = m_statResyncs = 0;
+            m_statDatagrams = 0;
+            m_statTime = {};
+        }
+    }
+
+    // joins, keepalives and acks from viewers
+    void Spectators::poll(Clock::time_point now)
+    {
+        while (int count = m_transport.receive())
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                const Datagram& datagram = m_transport.m_in[i];
+                auto viewer = std::find_if(m_viewers.begin(), m_viewers.end(), [&](const Viewer& v){
+                    return v.m_addr == datagram.m_addr && v.m_port == datagram.m_port;
+                });
+                if (datagram.m_size == 1 && datagram.m_data[0] == SpectatorJoin)
+                {
+                    if (viewer != m_viewers.end())
+                        viewer->m_lastSeen = now;
+                    else if (m_viewers.size() < MaxViewers)
+                    {
+                        m_viewers.push_back({datagram.m_addr, datagram.m_port, now, 0, 0, true, {}});
+                        std::cout << "spectator joined: " << endpoint(datagram.m_addr, datagram.m_port)
+                                  << " (" << m_viewers.size() << " viewers)" << std::endl;
+                    }
+                }
+                else if (datagram.m_size == 1 + sizeof(uint32_t) && datagram.m_data[0] == ScreenAck &&
+                         viewer != m_viewers.end())
+                {
+                    viewer->m_ackFrame = std::max(viewer->m_ackFrame, get32(datagram.m_data + 1));
+                    viewer->m_lastSeen = now;
+                }
+                else if (datagram.m_size == 1 + sizeof(uint32_t) && datagram.m_data[0] == Ping &&
+                         viewer != m_viewers.end())
+                {
+                    // viewers measure their round trip like p2 does
+                    uint8_t* p = m_transport.datagram();
+                    p[0] = Pong;
+                    std::memcpy(p + 1, datagram.m_data + 1, sizeof(uint32_t));
+                    put32(p + 5, timestamp_us());
+                    m_transport.push(9, datagram.m_addr, datagram.m_port);
+                }
+            }
+        }
+
+        auto timedOut = [&](const Viewer& v){ return now - v.m_lastSeen > std::chrono::milliseconds(ViewerTimeoutMs); };
+        for (auto& viewer : m_viewers)
+        {
+            if (timedOut(viewer))
+                std::cout << "spectator left: " << endpoint(viewer.m_addr, viewer.m_port) << std::endl;
+        }
+        m_viewers.erase(std::remove_if(m_viewers.begin(), m_viewers.end(), timedOut), m_viewers.end());
+    }
+
+    // the current frame as a keyframe, encoded once per frame however many viewers need it
+    const SharedFrame* Spectators::keyframe(const Netplug& netplug, const uint8_t* matrix)
+    {
+        uint32_t frame = netplug.m_frame;
+        if (m_key.m_frame == frame)
+            return &m_key;
+
+        m_key.m_frame = frame;
+        m_key.m_base = frame;
+        m_key.m_time = netplug.m_sentTime;
+        m_key.m_input = netplug.m_sentInput;
+        m_key.m_type = ScreenKey;
+        m_key.m_payload.clear();
+        if (netplug.m_pack && m_codec.encode(matrix, ScreenSize, m_key.m_payload) < ScreenSize)
+            m_key.m_type = ScreenKeyPacked;
+        else
+            m_key.m_payload.assign(matrix, matrix + ScreenSize);
+        m_key.m_chunks = (m_key.m_payload.size() + ChunkSize - 1) / ChunkSize;
+        make_parity(m_key, netplug.m_fecGroup);
+        ++m_statKeyframes;
+        return &m_key;
+    }
+
+    // one chunk per viewer in turn, until the queues are empty or the frame's budget is spent
+    void Spectators::pump()
+    {
+        std::size_t count = m_viewers.size();
+        int budget = MaxFanoutDatagrams;
+        bool more = true;
+        while (more && budget > 0)
+        {
+            more = false;
+            for (std::size_t i = 0; i < count && budget > 0; ++i)
+            {
+                Viewer& viewer = m_viewers[(m_next + i) % count];
+                auto& queue = viewer.m_queue;
+                while (!queue.empty() && queue.front().m_shared->m_frame != queue.front().m_frame)
+                {
+                    // overwritten before it went out
+                    queue.pop_front();
+                    viewer.m_needKey = true;
+                }
+                if (queue.empty())
+                    continue;
+
+                auto& pending = queue.front();
+                const SharedFrame* shared = pending.m_shared;
+                uint32_t total = shared->m_payload.size();
+                uint32_t offset = pending.m_chunk * ChunkSize;
+                uint32_t length = std::min<uint32_t>(total - offset, ChunkSize);
+                uint8_t* p = put_chunk_header(m_transport.datagram(), {shared->m_type, shared->m_frame, shared->m_base, total,
+                                                                       pending.m_chunk, shared->m_chunks, shared->m_time,
+                                                                       shared->m_input});
+                std::memcpy(p, shared->m_payload.data() + offset, length);
+                m_transport.push(ChunkHeaderSize + length, viewer.m_addr, viewer.m_port);
+                --budget;
+                ++m_statDatagrams;
+
+                int group = shared->m_fecGroup;
+                if (group > 1 && ((pending.m_chunk + 1) % group == 0 || pending.m_chunk + 1 == shared->m_chunks))
+                {
+                    uint16_t index = pending.m_chunk / group;
+                    uint32_t parityLength = std::min<uint32_t>(total - index * group * ChunkSize, ChunkSize);
+                    uint8_t* q = put_chunk_header(m_transport.datagram(), {ScreenParity, shared->m_frame, shared->m_base,
+                                                                           total, index, shared->m_chunks,
+                                                                           shared->m_time, shared->m_input});
+                    *q++ = shared->m_type;
+                    *q++ = group;
+                    std::memcpy(q, shared->m_parity.data() + index * ChunkSize, parityLength);
+                    m_transport.push(ParityHeaderSize + parityLength, viewer.m_addr, viewer.m_port);
+                    --budget;
+                    ++m_statDatagrams;
+                }
+
+                if (++pending.m_chunk == shared->m_chunks)
+                    queue.pop_front();
+                more |= !queue.empty();
+            }
+        }
+        m_transport.flush();
+        if (count)
+            m_next = (m_next + 1) % count;
+    }
+}
@@ -0,0 +1,125 @@
+#include "statehash.hpp"
+#include "cpu.hpp"
+#include "ppu.hpp"
+
+namespace NESemu
+{
+    const uint64_t Prime1 = 0x9E3779B185EBCA87ull;
+    const uint64_t Prime2 = 0xC2B2AE3D27D4EB4Full;
+    const uint64_t Prime3 = 0x165667B19E3779F9ull;
+    const uint64_t Prime4 = 0x85EBCA77C2B2AE63ull;
+    const uint64_t Prime5 = 0x27D4EB2F165667C5ull;
+
+    static inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+    // little-endian whatever the host
+    static inline uint64_t read64(const uint8_t* p)
+    {
+        uint64_t v = 0;
+        for (int i = 7; i >= 0; --i)
+            v = v << 8 | p[i];
+        return v;
+    }
+
+    static inline uint32_t read32(const uint8_t* p)
+    {
+        return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+    }
+
+    static inline uint64_t round(uint64_t acc, uint64_t input)
+    {
+        return rotl(acc + input * Prime2, 31) * Prime1;
+    }
+
+    static inline uint64_t merge(uint64_t acc, uint64_t value)
+    {
+        return (acc ^ round(0, value)) * Prime1 + Prime4;
+    }
+
+    uint64_t xxh64(const uint8_t* p, std::size_t size, uint64_t seed)
+    {
+        const uint8_t* end = p + size;
+        uint64_t h;
+        if (size >= 32)
+        {
+            uint64_t v1 = seed + Prime1 + Prime2, v2 = seed + Prime2, v3 = seed, v4 = seed - Prime1;
+            for (; p + 32 <= end; p += 32)
+            {
+                v1 = round(v1, read64(p));
+                v2 = round(v2, read64(p + 8));
+                v3 = round(v3, read64(p + 16));
+                v4 = round(v4, read64(p + 24));
+            }
+            h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+            h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+        }
+        else
+            h = seed + Prime5;
+        h += size;
+        for (; p + 8 <= end; p += 8)
+            h = rotl(h ^ round(0, read64(p)), 27) * Prime1 + Prime4;
+        if (p + 4 <= end)
+        {
+            h = rotl(h ^ (read32(p) * Prime1), 23) * Prime2 + Prime3;
+            p += 4;
+        }
+        for (; p < end; ++p)
+            h = rotl(h ^ (*p * Prime5), 11) * Prime1;
+        h ^= h >> 33;
+        h *= Prime2;
+        h ^= h >> 29;
+        h *= Prime3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    StateHash::StateHash() :
+        m_pages(),
+        m_statPages(0),
+        m_statCalls(0)
+    {}
+
+    uint64_t StateHash::update(CPU& cpu, PPU& ppu)
+    {
+        for (int page = 0; page < 8; ++page)
+        {
+            if (cpu.m_dirtyPages >> page & 1)
+            {
+                m_pages[page] = xxh64(&cpu.m_RAM[page * HashPageSize], HashPageSize);
+                ++m_statPages;
+            }
+            if (ppu.m_dirty >> page & 1)
+            {
+                m_pages[8 + page] = xxh64(&ppu.m_RAM[page * HashPageSize], HashPageSize);
+                ++m_statPages;
+            }
+        }
+        if (ppu.m_dirty & PPU::DirtyOAM)
+        {
+            m_pages[16] = xxh64(ppu.m_spriteMemory.data(), ppu.m_spriteMemory.size());
+            ++m_statPages;
+        }
+        if (ppu.m_dirty & PPU::DirtyPalette)
+        {
+            m_pages[17] = xxh64(ppu.m_palette.data(), ppu.m_palette.size());
+            ++m_statPages;
+        }
+        cpu.m_dirtyPages = 0;
+        ppu.m_dirty = 0;
+        ++m_statCalls;
+
+        uint8_t buffer[HashPages * 8 + 7];
+        uint8_t* p = buffer;
+        for (uint64_t page : m_pages)
+            for (int i = 0; i < 8; ++i)
+                *p++ = uint8_t(page >> (8 * i));
+        *p++ = uint8_t(cpu.r_PC);
+        *p++ = uint8_t(cpu.r_PC >> 8);
+        *p++ = cpu.r_SP;
+        *p++ = cpu.r_A;
+        *p++ = cpu.r_X;
+        *p++ = cpu.r_Y;
+        *p++ = cpu.f_N << 7 | cpu.f_V << 6 | cpu.f_D << 3 | cpu.f_I << 2 | cpu.f_Z << 1 | cpu.f_C;
+        return xxh64(buffer, sizeof(buffer));
+    }
+}
@@ -0,0 +1,502 @@
+#include "transport.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+namespace NESemu
+{
+    Transport::Transport() :
+        m_outCount(0),
+        m_inCount(0),
+        m_statSyscalls(0),
+        m_statSent(0),
+        m_statBytes(0),
+        m_statReceived(0),
+        m_sendLoss(0),
+        m_statLost(0),
+        m_shaping(),
+        m_heldOrder(0),
+        m_linkFree(0),
+        m_statShapedLost(0),
+        m_statQueueDrops(0),
+        m_statDuplicated(0),
+        m_statReordered(0),
+        m_prefixSize(0),
+        m_attached(false),
+        m_statInboxDrops(0),
+        m_peerPort(0),
+        m_anySource(false),
+        m_fd(-1)
+    {}
+
+    Transport::~Transport()
+    {
+        close();
+    }
+
+    bool Transport::open(unsigned short port, const std::string& peer, unsigned short peerPort, bool native)
+    {
+        close();
+        m_anySource = peer.empty();
+        m_peerAddr = m_anySource ? sf::IpAddress::None : sf::IpAddress(peer);
+        m_peerPort = peerPort;
+
+#ifdef __linux__
+        if (native)
+        {
+            m_fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+            sockaddr_in local = {};
+            local.sin_family = AF_INET;
+            local.sin_addr.s_addr = htonl(INADDR_ANY);
+            local.sin_port = htons(port);
+            int bufferSize = 1 << 20; // a few frames of raw screen
+            if (m_fd >= 0)
+            {
+                ::setsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+                ::setsockopt(m_fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+            }
+            if (m_fd >= 0 && ::bind(m_fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) == 0)
+            {
+                setup_batches();
+                return true;
+            }
+            std::cerr << "transport: native socket failed, using SFML" << std::endl;
+            close();
+        }
+#endif
+        if (m_socket.bind(port) != sf::Socket::Status::Done)
+        {
+            std::cerr << "transport: bind failed... " << port << std::endl;
+            return false;
+        }
+        m_socket.setBlocking(false);
+        m_selector.add(m_socket);
+        return true;
+    }
+
+    void Transport::setup_batches()
+    {
+#ifdef __linux__
+        m_peer = {};
+        m_peer.sin_family = AF_INET;
+        m_peer.sin_addr.s_addr = htonl(m_peerAddr.toInteger());
+        m_peer.sin_port = htons(m_peerPort);
+
+        // the batches never move, so the message headers are built once
+        for (int i = 0; i < DatagramBatch; ++i)
+        {
+            m_outIov[i] = {m_out[i].m_data, 0};
+            m_outMsg[i] = {};
+            m_outMsg[i].msg_hdr.msg_name = &m_outAddr[i];
+            m_outMsg[i].msg_hdr.msg_namelen = sizeof(m_outAddr[i]);
+            m_outMsg[i].msg_hdr.msg_iov = &m_outIov[i];
+            m_outMsg[i].msg_hdr.msg_iovlen = 1;
+
+            m_inIov[i] = {m_in[i].m_data, MaxDatagram};
+            m_inMsg[i] = {};
+            m_inMsg[i].msg_hdr.msg_name = &m_inAddr[i];
+            m_inMsg[i].msg_hdr.msg_iov = &m_inIov[i];
+            m_inMsg[i].msg_hdr.msg_iovlen = 1;
+        }
+#endif
+    }
+
+    bool Transport::attach(const Transport& owner, uint32_t addr, uint16_t port)
+    {
+        close();
+        if (!owner.isNative())
+            return false;
+        m_fd = owner.m_fd;
+        m_attached = true;
+        m_anySource = false;
+        m_peerAddr = sf::IpAddress(addr);
+        m_peerPort = port;
+        setup_batches();
+        return true;
+    }
+
+    void Transport::setPrefix(const uint8_t* prefix, std::size_t size)
+    {
+        m_prefixSize = std::min<std::size_t>(size, MaxPrefix);
+        std::memcpy(m_prefix, prefix, m_prefixSize);
+    }
+
+    void Transport::deliver(const Datagram& datagram, std::size_t offset)
+    {
+        std::lock_guard<std::mutex> lock(m_inboxLock);
+        if (m_inbox.size() >= MaxInbox)
+        {
+            ++m_statInboxDrops;
+            return;
+        }
+        m_inbox.emplace_back();
+        Datagram& copy = m_inbox.back();
+        copy.m_size = datagram.m_size - offset;
+        copy.m_addr = datagram.m_addr;
+        copy.m_port = datagram.m_port;
+        std::memcpy(copy.m_data, datagram.m_data + offset, copy.m_size);
+    }
+
+    void Transport::close()
+    {
+#ifdef __linux__
+        if (m_fd >= 0 && !m_attached)
+            ::close(m_fd);
+#endif
+        m_attached = false;
+        m_fd = -1;
+        m_selector.clear();
+        m_socket.unbind();
+        m_outCount = m_inCount = 0;
+        m_held.clear();
+    }
+
+    uint8_t* Transport::datagram()
+    {
+        if (m_outCount == DatagramBatch)
+            flush();
+        return m_out[m_outCount].m_data + m_prefixSize;
+    }
+
+    void Transport::push(std::size_t size)
+    {
+        push(size, m_peerAddr.toInteger(), m_peerPort);
+    }
+
+    void Transport::push(std::size_t size, uint32_t addr, uint16_t port)
+    {
+        auto& datagram = m_out[m_outCount++];
+        std::memcpy(datagram.m_data, m_prefix, m_prefixSize);
+        datagram.m_size = m_prefixSize + size;
+        datagram.m_addr = addr;
+        datagram.m_port = port;
+        if (m_outCount == DatagramBatch)
+            flush();
+    }
+
+    bool Transport::lose()
+    {
+        static thread_local std::minstd_rand random;
+        if (m_sendLoss <= 0 || std::uniform_real_distribution<double>()(random) >= m_sendLoss)
+            return false;
+        ++m_statLost;
+        return true;
+    }
+
+    void Transport::flush()
+    {
+        int count = 0;
+        for (int i = 0; i < m_outCount; ++i)
+        {
+            if (lose())
+                continue;
+            if (count != i)
+                m_out[count] = m_out[i];
+            ++count;
+        }
+        m_outCount = 0;
+#ifdef __linux__
+        if (m_fd >= 0)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                m_outIov[i].iov_len = m_out[i].m_size;
+                m_outAddr[i].sin_family = AF_INET;
+                m_outAddr[i].sin_addr.s_addr = htonl(m_out[i].m_addr);
+                m_outAddr[i].sin_port = htons(m_out[i].m_port);
+            }
+            int sent = 0;
+            while (sent < count)
+            {
+                int n = ::sendmmsg(m_fd, m_outMsg + sent, count - sent, 0);
+                ++m_statSyscalls;
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break; // lost, like any other datagram
+                sent += n;
+            }
+            m_statSent += sent;
+            for (int i = 0; i < sent; ++i)
+                m_statBytes += m_out[i].m_size;
+            return;
+        }
+#endif
+        for (int i = 0; i < count; ++i)
+        {
+            m_socket.send(m_out[i].m_data, m_out[i].m_size, sf::IpAddress(m_out[i].m_addr), m_out[i].m_port);
+            ++m_statSyscalls;
+            m_statBytes += m_out[i].m_size;
+        }
+        m_statSent += count;
+    }
+
+    void Transport::send(const uint8_t* data, std::size_t size)
+    {
+        if (lose())
+            return;
+        uint8_t prefixed[MaxDatagram];
+        if (m_prefixSize)
+        {
+            std::memcpy(prefixed, m_prefix, m_prefixSize);
+            std::memcpy(prefixed + m_prefixSize, data, size);
+            data = prefixed;
+            size += m_prefixSize;
+        }
+        ++m_statSyscalls;
+        ++m_statSent;
+        m_statBytes += size;
+#ifdef __linux__
+        if (m_fd >= 0)
+        {
+            ::sendto(m_fd, data, size, 0, reinterpret_cast<const sockaddr*>(&m_peer), sizeof(m_peer));
+            return;
+        }
+#endif
+        m_socket.send(data, size, m_peerAddr, m_peerPort);
+    }
+
+    // a reordered datagram is held this much longer than its neighbours
+    const int64_t ReorderHoldUs = 2000;
+
+    static int64_t steady_us()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool later(const HeldDatagram& a, const HeldDatagram& b)
+    {
+        return a.m_due != b.m_due ? a.m_due > b.m_due : a.m_order > b.m_order;
+    }
+
+    bool Transport::wait(int64_t timeoutUs)
+    {
+        if (m_held.empty())
+            return waitSocket(timeoutUs);
+        int64_t until = m_held.front().m_due - steady_us();
+        return until <= 0 || waitSocket(std::min(timeoutUs, until)) || timeoutUs >= until;
+    }
+
+    int Transport::receive()
+    {
+        int count = receiveSocket();
+        if (!m_shaping.active() && m_held.empty())
+            return count;
+
+        int64_t now = steady_us();
+        for (int i = 0; i < count; ++i)
+            hold(m_in[i], now);
+        m_inCount = 0;
+        while (!m_held.empty() && m_held.front().m_due <= now && m_inCount < DatagramBatch)
+        {
+            std::pop_heap(m_held.begin(), m_held.end(), later);
+            m_in[m_inCount++] = m_held.back().m_datagram;
+            m_held.pop_back();
+        }
+        return m_inCount;
+    }
+
+    void Transport::hold(const Datagram& datagram, int64_t now)
+    {
+        std::uniform_real_distribution<double> chance;
+        if (chance(m_random) < m_shaping.m_loss)
+        {
+            ++m_statShapedLost;
+            return;
+        }
+        // serialized through the bottleneck first, then the propagation delay
+        int64_t sent = now;
+        if (m_shaping.m_rateKbps > 0)
+        {
+            int64_t start = std::max(now, m_linkFree);
+            if (start - now > BottleneckQueueMs * 1000)
+            {
+                ++m_statQueueDrops;
+                return;
+            }
+            m_linkFree = start + int64_t(datagram.m_size * 8 * 1000 / m_shaping.m_rateKbps);
+            sent = m_linkFree;
+        }
+        int copies = 1;
+        if (chance(m_random) < m_shaping.m_duplicate)
+        {
+            copies = 2;
+            ++m_statDuplicated;
+        }
+        for (int i = 0; i < copies; ++i)
+        {
+            int64_t due = sent + int64_t((m_shaping.m_delayMs + chance(m_random) * m_shaping.m_jitterMs) * 1000);
+            if (chance(m_random) < m_shaping.m_reorder)
+            {
+                due += ReorderHoldUs;
+                ++m_statReordered;
+            }
+            m_held.push_back({due, m_heldOrder++, datagram});
+            std::push_heap(m_held.begin(), m_held.end(), later);
+        }
+    }
+
+    bool parse_shaping(const std::string& text, Shaping& shaping)
+    {
+        double values[6] = {};
+        std::istringstream in(text);
+        std::string field;
+        for (int i = 0; i < 6 && std::getline(in, field, ','); ++i)
+        {
+            try
+            {
+                values[i] = std::stod(field);
+            }
+            catch (const std::exception&)
+            {
+                return false;
+            }
+            if (values[i] < 0 || (i >= 2 && i <= 4 && values[i] > 100))
+                return false;
+        }
+        if (std::getline(in, field, ','))
+            return false;
+        shaping = {values[0], values[1], values[2] / 100, values[3] / 100, values[4] / 100, values[5]};
+        return true;
+    }
+
+    bool Transport::waitSocket(int64_t timeoutUs)
+    {
+        if (m_attached)
+        {
+            // the owner's reader does the waiting
+            std::lock_guard<std::mutex> lock(m_inboxLock);
+            return !m_inbox.empty();
+        }
+        timeoutUs = std::max<int64_t>(0, timeoutUs);
+#ifdef __linux__
+        if (m_fd >= 0)
+        {
+            pollfd fd = {m_fd, POLLIN, 0};
+            timespec timeout = {time_t(timeoutUs / 1000000), long(timeoutUs % 1000000 * 1000)};
+            ++m_statSyscalls;
+            return ::ppoll(&fd, 1, &timeout, nullptr) > 0;
+        }
+#endif
+        ++m_statSyscalls;
+        return m_selector.wait(sf::microseconds(timeoutUs));
+    }
+
+    int Transport::receiveSocket()
+    {
+        m_inCount = 0;
+        if (m_attached)
+        {
+            std::lock_guard<std::mutex> lock(m_inboxLock);
+            while (!m_inbox.empty() && m_inCount < DatagramBatch)
+            {
+                m_in[m_inCount++] = m_inbox.front();
+                m_inbox.pop_front();
+            }
+            m_statReceived += m_inCount;
+            return m_inCount;
+        }
+#ifdef __linux__
+        if (m_fd >= 0)
+        {
+            for (int i = 0; i < DatagramBatch; ++i)
+                m_inMsg[i].msg_hdr.msg_namelen = sizeof(m_inAddr[i]);
+            int n = ::recvmmsg(m_fd, m_inMsg, DatagramBatch, MSG_DONTWAIT, nullptr);
+            ++m_statSyscalls;
+            if (n <= 0)
+                return 0;
+            for (int i = 0; i < n; ++i)
+            {
+                bool fromPeer = m_anySource || (m_inAddr[i].sin_addr.s_addr == m_peer.sin_addr.s_addr &&
+                                                m_inAddr[i].sin_port == m_peer.sin_port);
+                m_in[i].m_size = fromPeer ? m_inMsg[i].msg_len : 0;
+                m_in[i].m_addr = ntohl(m_inAddr[i].sin_addr.s_addr);
+                m_in[i].m_port = ntohs(m_inAddr[i].sin_port);
+            }
+            m_inCount = n;
+            m_statReceived += n;
+            return n;
+        }
+#endif
+        sf::IpAddress remote_addr;
+        unsigned short remote_port;
+        std::size_t size;
+        while (m_inCount < DatagramBatch)
+        {
+            auto& datagram = m_in[m_inCount];
+            ++m_statSyscalls;
+            if (m_socket.receive(datagram.m_data, MaxDatagram, size, remote_addr, remote_port) != sf::Socket::Status::Done)
+                break;
+            datagram.m_size = (m_anySource || (remote_addr == m_peerAddr && remote_port == m_peerPort)) ? size : 0;
+            datagram.m_addr = remote_addr.toInteger();
+            datagram.m_port = remote_port;
+            ++m_inCount;
+        }
+        m_statReceived += m_inCount;
+        return m_inCount;
+    }
+
+    void transport_benchmark(unsigned short port, int frames)
+    {
+        // a raw frame: 49 datagrams of 17 byte header + 5 scanlines
+        const int Burst = 49;
+        const int Payload = 1280;
+        std::vector<uint8_t> frame(Burst * Payload);
+        for (std::size_t i = 0; i < frame.size(); ++i)
+            frame[i] = i * 7 & 0x3f;
+
+        for (bool native : {true, false})
+        {
+            Transport sender, receiver;
+            if (!sender.open(port, "127.0.0.1", port + 1, native) || !receiver.open(port + 1, "127.0.0.1", port, native))
+                continue;
+            if (native && !sender.isNative())
+                continue;
+
+            uint64_t received = 0;
+            auto wall = std::chrono::steady_clock::now();
+            std::clock_t cpu = std::clock();
+            for (int f = 0; f < frames; ++f)
+            {
+                for (int i = 0; i < Burst; ++i)
+                {
+                    uint8_t* p = sender.datagram();
+                    *p++ = 0;
+                    p = put32(p, f);
+                    p = put32(p, f);
+                    p = put32(p, frame.size());
+                    p = put16(p, i);
+                    p = put16(p, Burst);
+                    std::memcpy(p, frame.data() + i * Payload, Payload);
+                    sender.push(17 + Payload);
+                }
+                sender.flush();
+
+                int got = 0;
+                while (got < Burst && receiver.wait(5000))
+                    got += receiver.receive();
+                received += got;
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall).count();
+            double cpuUs = double(std::clock() - cpu) * 1e6 / CLOCKS_PER_SEC;
+
+            std::cout << (native ? "sendmmsg/recvmmsg" : "sf::UdpSocket") << ": "
+                      << uint64_t(received / seconds) << " packets/s, "
+                      << cpuUs / frames << " us CPU/frame, "
+                      << double(sender.m_statSyscalls + receiver.m_statSyscalls) / frames << " syscalls/frame, "
+                      << uint64_t(frames) * Burst - received << " lost" << std::endl;
+        }
+    }
+}